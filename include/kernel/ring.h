@@ -0,0 +1,66 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef KERNEL_RING_H
+#define KERNEL_RING_H
+
+#include "kernel/types.h"
+
+/*
+A ring lets a process queue many operations on its kernel objects
+and have them all carried out by one system call.  The ring lives
+in the process's own memory, and is registered with the kernel by
+syscall_ring_setup.  The process fills in submissions at sq_tail
+and advances it; syscall_ring_enter carries out each one from
+sq_head, posting its result at cq_tail.  The process takes the
+results from cq_head without entering the kernel.
+
+The head and tail counters run freely, and are reduced modulo
+RING_ENTRIES to index the queues.  The kernel stops taking
+submissions while the completion queue is full, so no result is
+ever lost.
+*/
+
+#define RING_ENTRIES 64
+
+typedef enum {
+	RING_OP_NOP,
+	RING_OP_READ,
+	RING_OP_WRITE,
+	RING_OP_SEEK,
+	RING_OP_LIST,
+	RING_OP_GRAPHICS,
+} ring_op_t;
+
+/*
+For RING_OP_SEEK, length is the offset and flags is whence.
+RING_OP_GRAPHICS writes a graphics stream to a window.
+*/
+
+struct ring_submission {
+	uint32_t user_data;
+	int32_t op;
+	int32_t fd;
+	uint32_t addr;
+	int32_t length;
+	int32_t flags;
+};
+
+struct ring_completion {
+	uint32_t user_data;
+	int32_t result;
+};
+
+struct ring {
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	struct ring_submission sq[RING_ENTRIES];
+	struct ring_completion cq[RING_ENTRIES];
+};
+
+#endif
@@ -8,6 +8,13 @@ struct system_stats {
 	int time;
 	int blocks_read[4];
 	int blocks_written[4];
+	int ksm_pages_shared;
+	int ksm_pages_saved;
+	int zram_pages;
+	int zram_bytes;
+	int zram_faults;
+	int swap_used;
+	int swap_total;
 };
 
 struct device_driver_stats {
@@ -21,6 +28,7 @@ struct bcache_stats {
 	int write_hits;
 	int write_misses;
 	int writebacks;
+	int evictions;
 };
 
 struct process_stats {
@@ -28,6 +36,13 @@ struct process_stats {
 	int blocks_written;
 	int bytes_read;
 	int bytes_written;
+	int zram_pages_out;
+	int zram_faults;
+	int swap_pages_out;
+	int swap_faults;
+	int slices_used;
+	int preemptions;
+	int fpu_loads;
 	int syscall_count[MAX_SYSCALL];
 };
 
@@ -50,6 +50,11 @@ typedef enum {
 	SYSCALL_SYSTEM_TIME,
 	SYSCALL_SYSTEM_RTC,
 	SYSCALL_DEVICE_DRIVER_STATS,
+	SYSCALL_OBJECT_MAP,
+	SYSCALL_OBJECT_UNMAP,
+	SYSCALL_PROCESS_SET_PRIORITY,
+	SYSCALL_RING_SETUP,
+	SYSCALL_RING_ENTER,
 	MAX_SYSCALL		// must be the last element in the enum
 } syscall_t;
 
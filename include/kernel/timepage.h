@@ -0,0 +1,33 @@
+#ifndef KERNEL_TIMEPAGE_H
+#define KERNEL_TIMEPAGE_H
+
+#include "kernel/types.h"
+
+/*
+The kernel maps one read-only page at TIME_PAGE_ADDRESS into every
+process, just above the area for mapped files, and keeps the time
+in it current, so that programs can read the clock without making
+a system call.  The kernel makes sequence odd while it changes the
+page, and even again when done: a reader copies what it needs,
+and tries again if sequence was odd or has since changed.
+
+seconds and millis are the time since boot as of the last clock
+interrupt.  If tsc_per_ms is not zero, the time since boot can be
+found more precisely from the time stamp counter, which read
+tsc_start at boot and counts tsc_per_ms each millisecond.  time
+and rtc are the wall clock, as of the last update of the RTC.
+*/
+
+#define TIME_PAGE_ADDRESS 0xf0000000
+
+struct time_page {
+	volatile uint32_t sequence;
+	uint32_t seconds;
+	uint32_t millis;
+	uint32_t tsc_per_ms;
+	uint64_t tsc_start;
+	uint32_t time;
+	struct rtc_time rtc;
+};
+
+#endif
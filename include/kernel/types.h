@@ -74,4 +74,16 @@ typedef enum {
 #define KNO_STDWIN  3
 #define KNO_STDDIR  4
 
+/*
+Scheduling priorities, from most to least urgent.  The realtime
+class is reserved for kernel tasks; user processes may choose
+a base priority from HIGH to LOW, and are moved below it while
+they use whole time slices.
+*/
+
+#define PROCESS_PRIORITY_REALTIME 0
+#define PROCESS_PRIORITY_HIGH     1
+#define PROCESS_PRIORITY_LOW      4
+#define PROCESS_PRIORITY_LEVELS   5
+
 #endif
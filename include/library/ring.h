@@ -0,0 +1,27 @@
+#ifndef LIBRARY_RING_H
+#define LIBRARY_RING_H
+
+#include "kernel/types.h"
+#include "kernel/ring.h"
+
+/*
+Queue operations on kernel objects with ring_read and friends,
+which return 0 if the submission queue is full, and carry them
+all out with one system call by ring_submit.  ring_complete then
+returns each result in turn, along with the user_data given to
+the operation, and returns 0 once there are no more.
+*/
+
+struct ring * ring_create();
+void ring_delete( struct ring *r );
+
+int ring_read( struct ring *r, int fd, void *data, int length, kernel_io_flags_t flags, uint32_t user_data );
+int ring_write( struct ring *r, int fd, const void *data, int length, kernel_io_flags_t flags, uint32_t user_data );
+int ring_seek( struct ring *r, int fd, int offset, int whence, uint32_t user_data );
+int ring_list( struct ring *r, int fd, char *buffer, int length, uint32_t user_data );
+int ring_graphics( struct ring *r, int fd, const int *commands, int length, uint32_t user_data );
+
+int ring_submit( struct ring *r );
+int ring_complete( struct ring *r, struct ring_completion *c );
+
+#endif
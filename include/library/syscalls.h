@@ -9,6 +9,7 @@ See the file LICENSE for details.
 
 #include "kernel/types.h"
 #include "kernel/stats.h"
+#include "kernel/ring.h"
 
 void syscall_debug(const char *str);
 
@@ -27,6 +28,7 @@ int syscall_process_reap(unsigned int pid);
 int syscall_process_wait(struct process_info *info, int timeout);
 int syscall_process_sleep(unsigned int ms);
 int syscall_process_stats(struct process_stats *s, unsigned int pid);
+int syscall_process_set_priority(unsigned int pid, int priority);
 extern void *syscall_process_heap(int a);
 
 /* Syscalls that open or create new kernel objects for this process. */
@@ -50,8 +52,13 @@ int syscall_object_remove( int fd, const char *name );
 int syscall_object_close(int fd);
 int syscall_object_set_tag(int fd, char *tag);
 int syscall_object_get_tag(int fd, char *buffer, int buffer_size);
+int syscall_object_map(int fd, void **addr, uint32_t length, uint32_t offset);
+int syscall_object_unmap(void *addr);
 int syscall_object_max();
 
+int syscall_ring_setup(struct ring *r);
+int syscall_ring_enter();
+
 /* Syscalls that query or affect the whole system state. */
 
 int syscall_system_stats(struct system_stats *s);
@@ -61,6 +68,7 @@ int syscall_bcache_flush();
 
 int syscall_system_time( uint32_t *t );
 int syscall_system_rtc( struct rtc_time *t );
+int syscall_system_uptime( uint32_t *seconds, uint32_t *millis );
 
 int syscall_device_driver_stats(char * name, struct device_driver_stats * stats);
 
@@ -0,0 +1,198 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "allocprof.h"
+#include "console.h"
+#include "string.h"
+#include "serial.h"
+
+#ifdef ALLOC_PROFILE
+
+/*
+Call sites are kept in a fixed size, open addressed hash table,
+so that recording never allocates memory itself.  Once the table
+is full, allocations from new sites are only counted as dropped.
+*/
+
+#define ALLOCPROF_SITES 256
+
+struct allocprof_site {
+	void *site;
+	int kind;
+	uint32_t allocs;
+	uint32_t frees;
+	uint32_t bytes;
+	uint32_t live_bytes;
+};
+
+static struct allocprof_site table[ALLOCPROF_SITES];
+static uint32_t dropped = 0;
+
+static const char *kind_names[] = { "kmalloc", "page" };
+
+static struct allocprof_site *allocprof_lookup(int kind, void *site)
+{
+	unsigned i;
+	unsigned h = ((uint32_t) site / 4 + kind) % ALLOCPROF_SITES;
+
+	for(i = 0; i < ALLOCPROF_SITES; i++) {
+		struct allocprof_site *s = &table[(h + i) % ALLOCPROF_SITES];
+		if(s->site == site && s->kind == kind)
+			return s;
+		if(!s->site) {
+			s->site = site;
+			s->kind = kind;
+			return s;
+		}
+	}
+
+	dropped++;
+	return 0;
+}
+
+void allocprof_alloc(int kind, void *site, uint32_t bytes)
+{
+	struct allocprof_site *s = allocprof_lookup(kind, site);
+	if(!s)
+		return;
+	s->allocs++;
+	s->bytes += bytes;
+	s->live_bytes += bytes;
+}
+
+void allocprof_free(int kind, void *site, uint32_t bytes)
+{
+	struct allocprof_site *s = allocprof_lookup(kind, site);
+	if(!s)
+		return;
+	s->frees++;
+	s->live_bytes -= bytes;
+}
+
+void allocprof_reset()
+{
+	memset(table, 0, sizeof(table));
+	dropped = 0;
+}
+
+/*
+Return the sites in order of decreasing live bytes,
+by selecting the largest site not yet visited each time.
+*/
+
+static struct allocprof_site *allocprof_next(struct allocprof_site *prev)
+{
+	unsigned i;
+	struct allocprof_site *best = 0;
+
+	for(i = 0; i < ALLOCPROF_SITES; i++) {
+		struct allocprof_site *s = &table[i];
+		if(!s->site)
+			continue;
+		if(prev && (s->live_bytes > prev->live_bytes || (s->live_bytes == prev->live_bytes && s <= prev)))
+			continue;
+		if(!best || s->live_bytes > best->live_bytes)
+			best = s;
+	}
+
+	return best;
+}
+
+void allocprof_print()
+{
+	struct allocprof_site *s;
+
+	printf("site     kind    allocs frees live bytes total bytes\n");
+
+	for(s = allocprof_next(0); s; s = allocprof_next(s)) {
+		printf("%x %s %d %d %d %d %d\n", s->site, kind_names[s->kind], s->allocs, s->frees, s->allocs - s->frees, s->live_bytes, s->bytes);
+	}
+
+	if(dropped)
+		printf("%d allocations from untracked sites\n", dropped);
+}
+
+static void allocprof_putstring(int port, const char *str)
+{
+	while(*str)
+		serial_write(port, *str++);
+}
+
+static void allocprof_putuint(int port, uint32_t u)
+{
+	char str[12];
+	allocprof_putstring(port, uint_to_string(u, str));
+}
+
+static void allocprof_puthex(int port, uint32_t u)
+{
+	int j;
+	for(j = 28; j >= 0; j -= 4) {
+		serial_write(port, "0123456789abcdef"[(u >> j) & 0xf]);
+	}
+}
+
+/*
+Write the table to a serial port as comma separated values,
+one line per site, for analysis on the host.
+*/
+
+void allocprof_export(int port)
+{
+	struct allocprof_site *s;
+	int block_size, nblocks;
+	char info[64];
+
+	if(!serial_device_probe(port, &block_size, &nblocks, info)) {
+		printf("allocprof: no serial port %d\n", port);
+		return;
+	}
+
+	allocprof_putstring(port, "site,kind,allocs,frees,live,live_bytes,total_bytes\r\n");
+
+	for(s = allocprof_next(0); s; s = allocprof_next(s)) {
+		allocprof_puthex(port, (uint32_t) s->site);
+		allocprof_putstring(port, ",");
+		allocprof_putstring(port, kind_names[s->kind]);
+		allocprof_putstring(port, ",");
+		allocprof_putuint(port, s->allocs);
+		allocprof_putstring(port, ",");
+		allocprof_putuint(port, s->frees);
+		allocprof_putstring(port, ",");
+		allocprof_putuint(port, s->allocs - s->frees);
+		allocprof_putstring(port, ",");
+		allocprof_putuint(port, s->live_bytes);
+		allocprof_putstring(port, ",");
+		allocprof_putuint(port, s->bytes);
+		allocprof_putstring(port, "\r\n");
+	}
+}
+
+#else
+
+void allocprof_alloc(int kind, void *site, uint32_t bytes)
+{
+}
+
+void allocprof_free(int kind, void *site, uint32_t bytes)
+{
+}
+
+void allocprof_reset()
+{
+}
+
+void allocprof_print()
+{
+	printf("allocprof: not enabled, rebuild the kernel with ALLOC_PROFILE=1\n");
+}
+
+void allocprof_export(int port)
+{
+	allocprof_print();
+}
+
+#endif
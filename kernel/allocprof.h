@@ -0,0 +1,30 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef ALLOCPROF_H
+#define ALLOCPROF_H
+
+#include "kernel/types.h"
+
+/*
+The allocation profiler is only compiled in when the kernel
+is built with ALLOC_PROFILE defined (make ALLOC_PROFILE=1).
+Each allocation is charged to the return address of its caller,
+and each free is charged back to the site that made the allocation,
+so that the table shows how much memory every call site holds.
+*/
+
+#define ALLOCPROF_KMALLOC 0
+#define ALLOCPROF_PAGE    1
+
+void allocprof_alloc(int kind, void *site, uint32_t bytes);
+void allocprof_free(int kind, void *site, uint32_t bytes);
+
+void allocprof_print();
+void allocprof_export(int port);
+void allocprof_reset();
+
+#endif
@@ -13,6 +13,7 @@ See the file LICENSE for details.
 #include "device.h"
 #include "process.h"
 #include "mutex.h"
+#include "workqueue.h"
 
 #define ATA_IRQ0	32+14
 #define ATA_IRQ1	32+15
@@ -475,16 +476,51 @@ static int ata_probe_internal( int id, int kind, int *nblocks, int *blocksize, c
 	return 1;
 }
 
+/*
+Probing resets the unit, so it must not overlap a transfer,
+nor another probe of the same controller.
+*/
+
+static int ata_probe_locked( int id, int kind, int *nblocks, int *blocksize, char *name )
+{
+	int result;
+	mutex_lock(&ata_mutex);
+	result = ata_probe_internal(id,kind,nblocks,blocksize,name);
+	mutex_unlock(&ata_mutex);
+	return result;
+}
+
 int ata_probe( int id, int *nblocks, int *blocksize, char *name )
 {
-	return ata_probe_internal(id,ATA_COMMAND_IDENTIFY,nblocks,blocksize,name);
+	return ata_probe_locked(id,ATA_COMMAND_IDENTIFY,nblocks,blocksize,name);
 }
 
 int atapi_probe( int id, int *nblocks, int *blocksize, char *name )
 {
-	return ata_probe_internal(id,ATAPI_COMMAND_IDENTIFY,nblocks,blocksize,name);
+	return ata_probe_locked(id,ATAPI_COMMAND_IDENTIFY,nblocks,blocksize,name);
 }
 
+/*
+The boot time survey of the units only reports what is attached,
+and a missing unit takes a full identify timeout to give up on,
+so it is left to a worker rather than holding up the boot.
+Each device is probed again when it is opened.
+*/
+
+static void ata_probe_all( struct work *w )
+{
+	int i;
+	int nblocks;
+	int blocksize = 0;
+	char longname[256];
+
+	for(i = 0; i < 4; i++) {
+		ata_probe_locked(i, 0, &nblocks, &blocksize, longname);
+	}
+}
+
+static struct work ata_probe_work = WORK_INIT(ata_probe_all, 0);
+
 static struct device_driver ata_driver = {
 	.name          = "ata",
 	.probe         = ata_probe,
@@ -503,12 +539,6 @@ static struct device_driver atapi_driver = {
 
 void ata_init()
 {
-	int i;
-
-	int nblocks;
-	int blocksize = 0;
-
-	char longname[256];
 	for (int i = 0; i < 4; i++) {
 		counters.blocks_read[i] = 0;
 		counters.blocks_written[i] = 0;
@@ -522,11 +552,8 @@ void ata_init()
 	interrupt_register(ATA_IRQ1, ata_interrupt);
 	interrupt_enable(ATA_IRQ1);
 
-	printf("ata: probing devices\n");
-
-	for(i = 0; i < 4; i++) {
-		ata_probe_internal(i, 0, &nblocks, &blocksize, longname);
-	}
+	printf("ata: probing devices in the background\n");
+	work_queue(&workqueue_system, &ata_probe_work);
 
 	device_driver_register(&ata_driver);
 	device_driver_register(&atapi_driver);
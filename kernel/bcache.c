@@ -7,32 +7,71 @@ See the file LICENSE for details.
 #include "bcache.h"
 #include "list.h"
 #include "page.h"
-#include "kmalloc.h"
+#include "slab.h"
 #include "string.h"
 #include "kernel/error.h"
+#include "clock.h"
+#include "workqueue.h"
+#include "process.h"
+
+/*
+The cache has no fixed size: it grows for as long as pages
+are available, and gives them back through bcache_shrink
+when the page allocator runs short.  Entries are kept in
+least-recently-used order on the cache list, and are also
+chained into a hash table by device and block, so that
+lookups stay fast as the cache grows with memory.
+
+Writes only dirty the cached block.  The first write after the
+cache is clean starts a timer, and BCACHE_WRITEBACK_MS later a
+work item writes back every dirty block, oldest first, so that
+the writer does not wait for the disk.
+
+A new entry is busy until its caller has filled it, since reading
+the block may block.  A busy entry is never evicted, and anyone
+else looking up the same block waits until it is ready.
+*/
+
+#define BCACHE_WRITEBACK_MS 1000
 
 struct bcache_entry {
 	struct list_node node;
+	struct bcache_entry *hash_next;
 	struct device *device;
 	int block;
 	int dirty;
+	int busy;
 	char *data;
 };
 
+#define BCACHE_HASH_SIZE 1024
+#define BCACHE_HASH(device,block) ((((unsigned)(device))/sizeof(void*)+(unsigned)(block))%BCACHE_HASH_SIZE)
+
 static struct list cache = LIST_INIT;
+static struct bcache_entry *hash[BCACHE_HASH_SIZE];
 static struct bcache_stats stats = {0};
-static int max_cache_size = 100;
+static struct list fill_queue = LIST_INIT;
+
+static struct slab_cache bcache_entry_cache = SLAB_CACHE_INIT("bcache_entry", sizeof(struct bcache_entry), 0);
+
+static void bcache_writeback(struct work *w);
+static void bcache_writeback_timer(struct clock_timer *t);
+
+static struct work writeback_work = WORK_INIT(bcache_writeback, 0);
+static struct clock_timer writeback_timer = CLOCK_TIMER_INIT(bcache_writeback_timer, 0);
 
 struct bcache_entry * bcache_entry_create( struct device *device, int block )
 {
-	struct bcache_entry *e = kmalloc(sizeof(*e));
+	struct bcache_entry *e = slab_alloc(&bcache_entry_cache);
 	if(!e) return 0;
 
 	e->device = device;
 	e->block = block;
+	e->dirty = 0;
+	e->busy = 0;
 	e->data = page_alloc(1);
 	if(!e->data) {
-		kfree(e);
+		slab_free(&bcache_entry_cache, e);
 		return 0;
 	}
 
@@ -44,39 +83,119 @@ void bcache_entry_delete( struct bcache_entry *e )
 {
 	if(e) {
 		if(e->data) page_free(e->data);
-		kfree(e);
+		slab_free(&bcache_entry_cache, e);
 	}
 }
 
+/*
+The device may block while writing, and meanwhile the entry may
+be written again or evicted, so it is marked clean before the
+write begins, and its page is held until the write is done.
+*/
+
 void bcache_entry_clean( struct bcache_entry *e )
 {
 	if(e->dirty) {
-		device_write(e->device,e->data,1,e->block);
-		// XXX How to deal with failure here?
+		char *data = e->data;
 		e->dirty = 0;
+		page_addref(data);
+		device_write(e->device,data,1,e->block);
+		// XXX How to deal with failure here?
+		page_free(data);
 		stats.writebacks++;
 	}
 
 }
 
-void bcache_trim()
+static void bcache_insert( struct bcache_entry *e )
 {
-	struct bcache_entry *e;
+	unsigned h = BCACHE_HASH(e->device,e->block);
+	e->hash_next = hash[h];
+	hash[h] = e;
+	list_push_head(&cache,&e->node);
+}
+
+static void bcache_remove( struct bcache_entry *e )
+{
+	struct bcache_entry **p = &hash[BCACHE_HASH(e->device,e->block)];
+	while(*p!=e) p = &(*p)->hash_next;
+	*p = e->hash_next;
+	list_remove(&e->node);
+}
+
+/*
+Called by the page allocator under memory pressure:
+write back and discard the least recently used entries
+until npages pages have been released or the cache is empty.
+A dirty entry is passed over when the caller cannot wait
+for it to be written back.
+*/
 
-	while(list_size(&cache)>max_cache_size) {
-		e = (struct bcache_entry *) list_pop_tail(&cache);
+static unsigned bcache_shrink( unsigned npages, int can_block )
+{
+	unsigned count = 0;
+	struct list_node *n, *prev;
+
+	for(n=cache.tail;n && count<npages;n=prev) {
+		struct bcache_entry *e = (struct bcache_entry *) n;
+		prev = n->prev;
+		if(e->busy || (e->dirty && !can_block)) continue;
+		bcache_remove(e);
 		bcache_entry_clean(e);
 		bcache_entry_delete(e);
+		stats.evictions++;
+		count++;
 	}
+
+	return count;
 }
 
-struct bcache_entry * bcache_find( struct device *device, int block )
+static struct page_shrinker bcache_shrinker = PAGE_SHRINKER_INIT("bcache",bcache_shrink);
+
+/*
+Find the least recently used dirty entry of the device,
+or of any device if device is null.
+*/
+
+static struct bcache_entry * bcache_oldest_dirty( struct device *device )
 {
 	struct list_node *n;
+	for(n=cache.tail;n;n=n->prev) {
+		struct bcache_entry *e = (struct bcache_entry *) n;
+		if(e->dirty && (!device || e->device==device)) return e;
+	}
+	return 0;
+}
+
+/*
+Each write may block, and meanwhile the entry may be evicted,
+so the search starts over after each one, rather than following
+a list that may have changed meanwhile.
+*/
+
+static void bcache_writeback( struct work *w )
+{
 	struct bcache_entry *e;
+	while((e = bcache_oldest_dirty(0))) {
+		bcache_entry_clean(e);
+	}
+}
+
+static void bcache_writeback_timer( struct clock_timer *t )
+{
+	work_queue(&workqueue_system,&writeback_work);
+}
 
-	for(n=cache.head;n;n=n->next) {
-		e = (struct bcache_entry *)n;
+void bcache_init()
+{
+	page_shrinker_register(&bcache_shrinker);
+}
+
+struct bcache_entry * bcache_find( struct device *device, int block )
+{
+	struct bcache_entry *e;
+
+	for(e=hash[BCACHE_HASH(device,block)];e;e=e->hash_next) {
 		if(e->device==device && e->block==block) {
 			return e;
 		}
@@ -85,23 +204,49 @@ struct bcache_entry * bcache_find( struct device *device, int block )
 	return 0;
 }
 
+/*
+A miss returns a new entry that is busy, and the caller must
+fill it and then call bcache_entry_ready or bcache_entry_discard.
+*/
+
 struct bcache_entry * bcache_find_or_create( struct device *device, int block, int *was_a_hit )
 {
-	struct bcache_entry *e = bcache_find(device,block);
+	struct bcache_entry *e;
+
+	// the entry may be discarded while waiting, so look it up again
+	while((e = bcache_find(device,block)) && e->busy) {
+		process_wait(&fill_queue);
+	}
+
 	if(e) {
 		*was_a_hit = 1;
+		// move to the front, so the tail is always the least recently used
+		list_remove(&e->node);
+		list_push_head(&cache,&e->node);
 	} else {
 		*was_a_hit = 0;
 		e = bcache_entry_create(device,block);
 		if(!e) return 0;
-		list_push_head(&cache,&e->node);
+		e->busy = 1;
+		bcache_insert(e);
 	}
 
-	bcache_trim();
-
 	return e;
 }
 
+static void bcache_entry_ready( struct bcache_entry *e )
+{
+	e->busy = 0;
+	process_wakeup_all(&fill_queue);
+}
+
+static void bcache_entry_discard( struct bcache_entry *e )
+{
+	bcache_remove(e);
+	bcache_entry_delete(e);
+	process_wakeup_all(&fill_queue);
+}
+
 int bcache_read_block( struct device *device, char *data, int block )
 {
 	int hit=0;
@@ -120,14 +265,44 @@ int bcache_read_block( struct device *device, char *data, int block )
 
 	if(result>0) {
 		memcpy(data,e->data,device_block_size(device));
+		if(!hit) bcache_entry_ready(e);
 	} else {
-		list_remove(&e->node);
-		bcache_entry_delete(e);
+		bcache_entry_discard(e);
 	}
 
 	return result;
 }
 
+/*
+Like bcache_read_block, but instead of copying the data out,
+return the cache's own page holding the block, with a reference
+held for the caller.  The page stays valid after the entry
+is evicted, until the caller releases it with page_free.
+Only useful when blocks are a full page in size.
+*/
+
+char *bcache_map_block( struct device *device, int block )
+{
+	int hit=0;
+
+	struct bcache_entry *e = bcache_find_or_create(device,block,&hit);
+	if(!e) return 0;
+
+	if(hit) {
+		stats.read_hits++;
+	} else {
+		stats.read_misses++;
+		if(device_read(device,e->data,1,block)<1) {
+			bcache_entry_discard(e);
+			return 0;
+		}
+		bcache_entry_ready(e);
+	}
+
+	page_addref(e->data);
+	return e->data;
+}
+
 int bcache_read( struct device *device, char *data, int blocks, int offset )
 {
 	int i,r;
@@ -163,6 +338,10 @@ int bcache_write_block( struct device *device, const char *data, int block )
 
 	memcpy(e->data,data,device_block_size(device));
 	e->dirty = 1;
+	if(!hit) bcache_entry_ready(e);
+
+	if(!clock_timer_pending(&writeback_timer) && !work_pending(&writeback_work))
+		clock_timer_start(&writeback_timer,clock_read_us()+BCACHE_WRITEBACK_MS*1000);
 
 	return 1;
 }
@@ -194,26 +373,22 @@ void bcache_flush_block( struct device *device, int block )
 	if(e) bcache_entry_clean(e);
 }
 
+/*
+As with bcache_writeback, the search starts over after each write.
+*/
+
 void bcache_flush_device( struct device *device )
 {
-	struct list_node *n;
 	struct bcache_entry *e;
-
-	for(n=cache.head;n;n=n->next) {
-		e = (struct bcache_entry *) n;
-		if(e->device==device) {
-			bcache_entry_clean(e);
-		}
+	while((e = bcache_oldest_dirty(device))) {
+		bcache_entry_clean(e);
 	}
 }
 
 void bcache_flush_all()
 {
-	struct list_node *n;
 	struct bcache_entry *e;
-
-	for(n=cache.head;n;n=n->next) {
-		e = (struct bcache_entry *) n;
+	while((e = bcache_oldest_dirty(0))) {
 		bcache_entry_clean(e);
 	}
 }
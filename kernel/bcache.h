@@ -10,10 +10,13 @@ See the file LICENSE for details.
 #include "device.h"
 #include "kernel/stats.h"
 
+void bcache_init();
+
 int  bcache_read( struct device *d, char *data, int blocks, int offset );
 int  bcache_write( struct device *d, const char *data, int blocks, int offset );
 
 int  bcache_read_block( struct device *d, char *data, int block );
+char *bcache_map_block( struct device *d, int block );
 int  bcache_write_block( struct device *d, const char *data, int block );
 
 void bcache_flush_block( struct device *d, int block );
@@ -18,7 +18,7 @@ See the file LICENSE for details.
 
 static struct fs_dirent *cdrom_dirent_create(struct fs_volume *volume, int sector, int length, int isdir)
 {
-	struct fs_dirent *d = kmalloc(sizeof(*d));
+	struct fs_dirent *d = fs_dirent_alloc();
 	if(!d) return 0;
 
 	d->volume = volume;
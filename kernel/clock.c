@@ -8,37 +8,112 @@ See the file LICENSE for details.
 #include "clock.h"
 #include "ioports.h"
 #include "process.h"
+#include "lapic.h"
+#include "console.h"
+#include "cpu.h"
+#include "timepage.h"
 
-// Minimum PIT frequency is 18.2Hz.
-#define CLICKS_PER_SECOND 20
+/*
+Time is read from the processor's time stamp counter, calibrated
+against the PIT at boot, so clock_read() is exact to the microsecond
+and needs no interrupts to keep it current.  Rather than ticking
+at a fixed rate, the local APIC timer is set for the next moment
+that anything needs to happen: the end of the running process's
+time slice, or the earliest deadline of a pending timer.
+When the processor is idle and no timer is pending, no timer
+interrupts occur at all.  Each processor keeps the end of its own
+time slice and programs its own local APIC; the timers are shared,
+and whichever processor sees one expire first runs it.
+
+On a processor without a TSC or local APIC, the PIT ticks at
+CLICKS_PER_SECOND instead, and the same deadlines are checked
+on every tick.
+*/
+
+#define CLICKS_PER_SECOND 100
 
 #define TIMER0		0x40
+#define TIMER2		0x42
 #define TIMER_MODE	0x43
+#define TIMER_GATE	0x61
 #define SQUARE_WAVE     0x36
+#define ONE_SHOT2	0xb0
 #define TIMER_FREQ	1193182
 #define TIMER_COUNT	(((unsigned)TIMER_FREQ)/CLICKS_PER_SECOND)
 
+#define CPUID_FEATURE_TSC (1<<4)
+
+#define CLOCK_CALIBRATE_MS 10
+#define CLOCK_SLICE_DEFAULT 20
+#define CLOCK_EVENT_MIN_US 20
+#define CLOCK_EVENT_MAX_US 1000000
+
 static uint32_t clicks = 0;
-static uint32_t seconds = 0;
 
-static struct list queue = { 0, 0 };
+static uint64_t tsc_start = 0;
+static uint32_t tsc_per_ms = 0;
+static uint32_t lapic_per_ms = 0;
 
-static void clock_interrupt(int i, int code)
+static uint32_t slice_ms = CLOCK_SLICE_DEFAULT;
+
+/*
+The heap of pending timers is indexed from one, so that the children
+of entry i are 2i and 2i+1, and each timer records its own index so
+that it can be cancelled without a search.  An index of zero means
+the timer is not pending.  There is room for one sleeping timer
+per process, plus some for the kernel's own use.
+*/
+
+#define CLOCK_TIMERS_MAX (PROCESS_MAX_PID + 64)
+
+static struct clock_timer *heap[CLOCK_TIMERS_MAX + 1];
+static int heap_size = 0;
+
+static struct list sleep_queue = LIST_INIT;
+
+static uint64_t clock_rdtsc()
 {
-	clicks++;
-	process_wakeup_all(&queue);
-	if(clicks >= CLICKS_PER_SECOND) {
-		clicks = 0;
-		seconds++;
-		process_preempt();
+	uint32_t lo, hi;
+	asm volatile("rdtsc":"=a"(lo), "=d"(hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+
+/*
+Divide a 64 bit value by a 32 bit value with two divl instructions,
+since the kernel is not linked with the compiler's runtime library.
+*/
+
+static uint64_t clock_divide(uint64_t n, uint32_t d, uint32_t *remainder)
+{
+	uint32_t hi = n >> 32;
+	uint32_t lo = n;
+	uint32_t qhi = hi / d;
+	uint32_t qlo, r = hi % d;
+
+	asm("divl %4":"=a"(qlo), "=d"(r):"a"(lo), "d"(r), "rm"(d));
+
+	if(remainder)
+		*remainder = r;
+	return ((uint64_t) qhi << 32) | qlo;
+}
+
+uint64_t clock_read_us()
+{
+	if(tsc_per_ms) {
+		uint32_t r;
+		uint64_t ms = clock_divide(clock_rdtsc() - tsc_start, tsc_per_ms, &r);
+		return ms * 1000 + clock_divide((uint64_t) r * 1000, tsc_per_ms, 0);
+	} else {
+		return (uint64_t) clicks * (1000000 / CLICKS_PER_SECOND);
 	}
 }
 
 clock_t clock_read()
 {
 	clock_t result;
-	result.seconds = seconds;
-	result.millis = 1000 * clicks / CLICKS_PER_SECOND;
+	uint32_t us;
+	result.seconds = clock_divide(clock_read_us(), 1000000, &us);
+	result.millis = us / 1000;
 	return result;
 }
 
@@ -54,26 +129,300 @@ clock_t clock_diff(clock_t start, clock_t stop)
 	return result;
 }
 
+/*
+Timers may be started from interrupt handlers as well as from
+ordinary kernel code, so interrupts are blocked while the heap is
+changed, and restored to the caller's state afterwards.
+*/
+
+static uint32_t clock_lock()
+{
+	uint32_t flags;
+	asm volatile("pushfl; popl %0; cli":"=r"(flags)::"memory");
+	return flags;
+}
+
+static void clock_unlock(uint32_t flags)
+{
+	if(flags & 0x200)
+		asm volatile("sti":::"memory");
+}
+
+static void clock_heap_set(int i, struct clock_timer *t)
+{
+	heap[i] = t;
+	t->index = i;
+}
+
+static void clock_heap_up(int i)
+{
+	struct clock_timer *t = heap[i];
+
+	while(i > 1 && heap[i / 2]->deadline > t->deadline) {
+		clock_heap_set(i, heap[i / 2]);
+		i /= 2;
+	}
+
+	clock_heap_set(i, t);
+}
+
+static void clock_heap_down(int i)
+{
+	struct clock_timer *t = heap[i];
+
+	while(2 * i <= heap_size) {
+		int c = 2 * i;
+		if(c < heap_size && heap[c + 1]->deadline < heap[c]->deadline)
+			c++;
+		if(heap[c]->deadline >= t->deadline)
+			break;
+		clock_heap_set(i, heap[c]);
+		i = c;
+	}
+
+	clock_heap_set(i, t);
+}
+
+static void clock_heap_remove(struct clock_timer *t)
+{
+	int i = t->index;
+	struct clock_timer *last = heap[heap_size--];
+
+	t->index = 0;
+
+	if(last != t) {
+		clock_heap_set(i, last);
+		clock_heap_up(i);
+		clock_heap_down(last->index);
+	}
+}
+
+/*
+Set the local APIC timer for the earlier of the end of the
+current time slice and the first pending timer, or stop it if neither.
+Events further away than CLOCK_EVENT_MAX_US are reached in steps,
+so that the count cannot overflow.
+*/
+
+static void clock_program()
+{
+	if(!lapic_per_ms)
+		return;
+
+	uint64_t slice_end = cpu_self()->slice_end;
+	uint64_t deadline = heap_size ? heap[1]->deadline : 0;
+	if(slice_end && (!deadline || slice_end < deadline))
+		deadline = slice_end;
+
+	if(!deadline) {
+		lapic_timer_set(0, 0);
+		return;
+	}
+
+	uint64_t now = clock_read_us();
+	uint32_t us = CLOCK_EVENT_MIN_US;
+	if(deadline > now + CLOCK_EVENT_MAX_US)
+		us = CLOCK_EVENT_MAX_US;
+	else if(deadline > now + CLOCK_EVENT_MIN_US)
+		us = deadline - now;
+
+	lapic_timer_set(clock_divide((uint64_t) us * lapic_per_ms, 1000, 0), 1);
+}
+
+static void clock_event()
+{
+	uint64_t now = clock_read_us();
+	uint32_t us;
+	uint32_t seconds = clock_divide(now, 1000000, &us);
+
+	timepage_set_clock(seconds, us / 1000);
+
+	while(heap_size && heap[1]->deadline <= now) {
+		struct clock_timer *t = heap[1];
+		clock_heap_remove(t);
+		t->func(t);
+	}
+
+	uint64_t slice_end = cpu_self()->slice_end;
+	if(slice_end && now >= slice_end)
+		process_slice_expired();
+
+	clock_program();
+}
+
+static void clock_interrupt(int i, int code)
+{
+	clicks++;
+	clock_event();
+}
+
+static void clock_lapic_interrupt(int i, int code)
+{
+	clock_event();
+}
+
+/*
+Called by process_switch whenever a process is given the processor,
+to give it a full time slice from now.  Processes at lower priority
+levels are given longer slices.
+*/
+
+void clock_slice_start()
+{
+	struct cpu *c = cpu_self();
+	if(current) {
+		c->slice_end = clock_read_us() + (uint64_t) slice_ms * 1000 * process_slice_scale(current);
+	} else {
+		c->slice_end = 0;
+	}
+	clock_program();
+}
+
+void clock_slice_set(uint32_t millis)
+{
+	if(millis > 0)
+		slice_ms = millis;
+}
+
+uint32_t clock_slice_get()
+{
+	return slice_ms;
+}
+
+void clock_timer_init(struct clock_timer *t, clock_timer_func_t func, void *arg)
+{
+	t->deadline = 0;
+	t->func = func;
+	t->arg = arg;
+	t->index = 0;
+}
+
+/*
+Start the timer for the given deadline, moving it if already pending.
+Returns 0 if there are too many timers pending.
+*/
+
+int clock_timer_start(struct clock_timer *t, uint64_t deadline)
+{
+	uint32_t flags = clock_lock();
+
+	if(t->index)
+		clock_heap_remove(t);
+
+	if(heap_size >= CLOCK_TIMERS_MAX) {
+		clock_unlock(flags);
+		return 0;
+	}
+
+	t->deadline = deadline;
+	heap[++heap_size] = t;
+	clock_heap_up(heap_size);
+
+	if(t->index == 1)
+		clock_program();
+
+	clock_unlock(flags);
+	return 1;
+}
+
+void clock_timer_cancel(struct clock_timer *t)
+{
+	uint32_t flags = clock_lock();
+	if(t->index)
+		clock_heap_remove(t);
+	clock_unlock(flags);
+}
+
+int clock_timer_pending(struct clock_timer *t)
+{
+	return t->index != 0;
+}
+
+static void clock_wakeup(struct clock_timer *t)
+{
+	process_wakeup_one(t->arg);
+}
+
+/*
+A sleeping process waits on its own timer, kept in the process
+so that it can be cancelled if the process is killed while asleep.
+Only the process whose deadline has passed is woken.
+*/
+
 void clock_wait(uint32_t millis)
 {
-	clock_t start, elapsed;
-	uint32_t total;
+	uint64_t deadline = clock_read_us() + (uint64_t) millis * 1000;
+	struct clock_timer *t = &current->sleep_timer;
 
-	start = clock_read();
-	do {
-		process_wait(&queue);
-		elapsed = clock_diff(start, clock_read());
-		total = elapsed.millis + elapsed.seconds * 1000;
-	} while(total < millis);
+	interrupt_block();
+	while(clock_read_us() < deadline) {
+		clock_timer_init(t, clock_wakeup, current);
+		if(clock_timer_start(t, deadline)) {
+			process_wait(&sleep_queue);
+		} else {
+			process_yield();
+		}
+		interrupt_block();
+	}
+	interrupt_unblock();
+}
+
+/*
+Measure the TSC and the local APIC timer against a known interval
+of the PIT: channel 2 counts down once, with its output visible
+in the speaker port, while the other two run freely.
+*/
+
+static void clock_calibrate(int has_tsc, int has_lapic)
+{
+	uint32_t count = TIMER_FREQ / 1000 * CLOCK_CALIBRATE_MS;
+
+	outb((inb(TIMER_GATE) & ~0x02) | 0x01, TIMER_GATE);
+	outb(ONE_SHOT2, TIMER_MODE);
+	outb(count & 0xff, TIMER2);
+	outb((count >> 8) & 0xff, TIMER2);
+
+	if(has_lapic)
+		lapic_timer_set(0xffffffff, 0);
+	uint64_t start = clock_rdtsc();
+
+	while(!(inb(TIMER_GATE) & 0x20)) {
+	}
+
+	uint64_t stop = clock_rdtsc();
+	if(has_lapic) {
+		lapic_per_ms = (0xffffffff - lapic_timer_remaining()) / CLOCK_CALIBRATE_MS;
+		lapic_timer_set(0, 0);
+	}
+	if(has_tsc) {
+		tsc_per_ms = clock_divide(stop - start, CLOCK_CALIBRATE_MS, 0);
+		tsc_start = clock_rdtsc();
+	}
 }
 
 void clock_init()
 {
-	outb(SQUARE_WAVE, TIMER_MODE);
-	outb((TIMER_COUNT & 0xff), TIMER0);
-	outb((TIMER_COUNT >> 8) & 0xff, TIMER0);
+	uint32_t eax, ebx, ecx, edx;
+	asm("cpuid":"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx):"a"(1));
 
-	interrupt_register(32, clock_interrupt);
-	interrupt_enable(32);
+	int has_tsc = (edx & CPUID_FEATURE_TSC) != 0;
+	int has_lapic = lapic_init();
 
+	clock_calibrate(has_tsc, has_lapic);
+	timepage_set_tsc(tsc_start, tsc_per_ms);
+
+	if(tsc_per_ms && lapic_per_ms) {
+		interrupt_register(INTERRUPT_LAPIC_TIMER, clock_lapic_interrupt);
+		printf("clock: tickless, tsc %d kHz, lapic timer %d kHz\n", tsc_per_ms, lapic_per_ms);
+	} else {
+		lapic_per_ms = 0;
+
+		outb(SQUARE_WAVE, TIMER_MODE);
+		outb((TIMER_COUNT & 0xff), TIMER0);
+		outb((TIMER_COUNT >> 8) & 0xff, TIMER0);
+
+		interrupt_register(32, clock_interrupt);
+		interrupt_enable(32);
+		printf("clock: %d Hz tick\n", CLICKS_PER_SECOND);
+	}
 }
@@ -19,4 +19,35 @@ clock_t clock_read();
 clock_t clock_diff(clock_t start, clock_t stop);
 void clock_wait(uint32_t millis);
 
+uint64_t clock_read_us();
+void clock_slice_start();
+void clock_slice_set(uint32_t millis);
+uint32_t clock_slice_get();
+
+/*
+A timer calls its function once, from the clock interrupt, when the
+clock reaches its deadline (in microseconds, as from clock_read_us).
+Pending timers are kept in a min-heap by deadline, so that only the
+expired timers are visited, and the hardware timer is set for the
+earliest one.  A timer must be cancelled before its memory is reused.
+*/
+
+struct clock_timer;
+
+typedef void (*clock_timer_func_t) (struct clock_timer *t);
+
+struct clock_timer {
+	uint64_t deadline;
+	clock_timer_func_t func;
+	void *arg;
+	int index;
+};
+
+#define CLOCK_TIMER_INIT(func,arg) {0,func,arg,0}
+
+void clock_timer_init(struct clock_timer *t, clock_timer_func_t func, void *arg);
+int  clock_timer_start(struct clock_timer *t, uint64_t deadline);
+void clock_timer_cancel(struct clock_timer *t);
+int  clock_timer_pending(struct clock_timer *t);
+
 #endif
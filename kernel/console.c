@@ -7,7 +7,7 @@ See the file LICENSE for details.
 #include "console.h"
 #include "serial.h"
 #include "graphics.h"
-#include "kmalloc.h"
+#include "slab.h"
 #include "string.h"
 
 struct console {
@@ -23,6 +23,8 @@ struct console {
 
 struct console console_root = {0};
 
+static struct slab_cache console_cache = SLAB_CACHE_INIT("console", sizeof(struct console), 0);
+
 static struct graphics_color bgcolor = { 0, 0, 0 };
 static struct graphics_color fgcolor = { 255, 255, 255 };
 
@@ -206,7 +208,7 @@ void console_putstring( struct console *c, const char *str)
 
 struct console *console_create( struct window *w )
 {
-	struct console *c = kmalloc(sizeof(*c));
+	struct console *c = slab_alloc(&console_cache);
 	c->window = window_addref(w);
 	c->gx = window_graphics(w);
 	c->refcount = 1;
@@ -227,7 +229,7 @@ void console_delete( struct console *c )
 	c->refcount--;
 	if(c->refcount==0) {
 		window_delete(c->window);
-		kfree(c);
+		slab_free(&console_cache, c);
 	}
 }
 
@@ -0,0 +1,536 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "cpu.h"
+#include "lapic.h"
+#include "spinlock.h"
+#include "interrupt.h"
+#include "pagetable.h"
+#include "process.h"
+#include "clock.h"
+#include "page.h"
+#include "string.h"
+#include "console.h"
+#include "memorylayout.h"
+#include "fpu.h"
+
+/*
+The processors are found in the MP configuration table left by the
+BIOS, or failing that, in the ACPI MADT.  The boot processor is
+always cpu_table[0].  The others are started one at a time by
+cpu_start, each running the trampoline in kernelcore.S and then
+cpu_ap_main, which enters the scheduler like any other idle processor.
+*/
+
+#define CPU_STACK_ORDER 1
+#define CPU_STARTUP_TIMEOUT_US 100000
+
+#define CPUID_FEATURE_SEP (1<<11)
+
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+#define EFLAGS_TF (1<<8)
+
+struct cpu cpu_table[CPU_MAX];
+int cpu_count = 1;
+
+/* Read by the trampoline as each processor starts. */
+uint32_t cpu_boot_cr0 = 0;
+uint32_t cpu_boot_cr3 = 0;
+uint32_t cpu_boot_cr4 = 0;
+char *cpu_boot_stack = 0;
+struct cpu *cpu_boot_cpu = 0;
+
+extern char cpu_trampoline[];
+extern char cpu_trampoline_end[];
+extern struct x86_segment gdt[];
+extern char intr_sysenter[];
+
+static struct spinlock kernel_lock = SPINLOCK_INIT;
+static volatile uint32_t tlb_generation = 0;
+static int cpu_sysenter = 0;
+
+struct mp_floating {
+	char signature[4];
+	uint32_t config;
+	uint8_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	uint8_t type;
+	uint8_t features[4];
+};
+
+struct mp_config {
+	char signature[4];
+	uint16_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem[8];
+	char product[12];
+	uint32_t oem_table;
+	uint16_t oem_length;
+	uint16_t count;
+	uint32_t lapic;
+	uint16_t ext_length;
+	uint8_t ext_checksum;
+	uint8_t reserved;
+};
+
+#define MP_ENTRY_PROCESSOR 0
+#define MP_PROCESSOR_ENABLED 1
+
+struct mp_processor {
+	uint8_t type;
+	uint8_t apic_id;
+	uint8_t apic_version;
+	uint8_t flags;
+	uint32_t signature;
+	uint32_t features;
+	uint32_t reserved[2];
+};
+
+struct acpi_rsdp {
+	char signature[8];
+	uint8_t checksum;
+	char oem[6];
+	uint8_t revision;
+	uint32_t rsdt;
+};
+
+struct acpi_header {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem[6];
+	char oem_table[8];
+	uint32_t oem_revision;
+	uint32_t creator;
+	uint32_t creator_revision;
+};
+
+#define ACPI_MADT_LAPIC 0
+#define ACPI_LAPIC_ENABLED 1
+
+struct acpi_madt_lapic {
+	uint8_t type;
+	uint8_t length;
+	uint8_t acpi_id;
+	uint8_t apic_id;
+	uint32_t flags;
+};
+
+static int cpu_checksum(const void *p, int length)
+{
+	const uint8_t *b = p;
+	uint8_t sum = 0;
+	while(length-- > 0)
+		sum += *b++;
+	return sum == 0;
+}
+
+/*
+Look for a table with the given signature on a 16 byte boundary,
+whose first length bytes add up to zero.
+*/
+
+static void *cpu_scan(uint32_t start, uint32_t length, const char *signature, int siglen, int checklen)
+{
+	uint32_t addr;
+	for(addr = start; addr + checklen <= start + length; addr += 16) {
+		if(!memcmp((void *) addr, signature, siglen) && cpu_checksum((void *) addr, checklen))
+			return (void *) addr;
+	}
+	return 0;
+}
+
+static void *cpu_scan_bios(const char *signature, int siglen, int checklen, uint32_t rom_start)
+{
+	uint32_t ebda = *(uint16_t *) 0x40e << 4;
+	uint32_t base_top = *(uint16_t *) 0x413 * 1024;
+	void *p = 0;
+
+	if(ebda)
+		p = cpu_scan(ebda, 1024, signature, siglen, checklen);
+	if(!p && base_top)
+		p = cpu_scan(base_top - 1024, 1024, signature, siglen, checklen);
+	if(!p)
+		p = cpu_scan(rom_start, 0x100000 - rom_start, signature, siglen, checklen);
+	return p;
+}
+
+static void cpu_add(uint32_t apic_id)
+{
+	int i;
+	for(i = 0; i < cpu_count; i++) {
+		if(cpu_table[i].apic_id == apic_id)
+			return;
+	}
+	if(cpu_count >= CPU_MAX) {
+		printf("cpu: ignoring processor %d, only %d supported\n", apic_id, CPU_MAX);
+		return;
+	}
+	cpu_table[cpu_count].id = cpu_count;
+	cpu_table[cpu_count].apic_id = apic_id;
+	cpu_count++;
+}
+
+static int cpu_find_mp()
+{
+	struct mp_floating *f = cpu_scan_bios("_MP_", 4, sizeof(struct mp_floating), 0xf0000);
+	if(!f || !f->config)
+		return 0;
+
+	struct mp_config *c = (struct mp_config *) f->config;
+	if(memcmp(c->signature, "PCMP", 4) || !cpu_checksum(c, c->length))
+		return 0;
+
+	uint8_t *e = (uint8_t *) (c + 1);
+	int i;
+	for(i = 0; i < c->count; i++) {
+		if(*e == MP_ENTRY_PROCESSOR) {
+			struct mp_processor *p = (struct mp_processor *) e;
+			if(p->flags & MP_PROCESSOR_ENABLED)
+				cpu_add(p->apic_id);
+			e += sizeof(struct mp_processor);
+		} else {
+			e += 8;
+		}
+	}
+	return 1;
+}
+
+static int cpu_find_acpi()
+{
+	struct acpi_rsdp *r = cpu_scan_bios("RSD PTR ", 8, sizeof(struct acpi_rsdp), 0xe0000);
+	if(!r)
+		return 0;
+
+	struct acpi_header *rsdt = (struct acpi_header *) r->rsdt;
+	if(memcmp(rsdt->signature, "RSDT", 4) || !cpu_checksum(rsdt, rsdt->length))
+		return 0;
+
+	uint32_t *tables = (uint32_t *) (rsdt + 1);
+	int n = (rsdt->length - sizeof(*rsdt)) / 4;
+	int i;
+
+	for(i = 0; i < n; i++) {
+		struct acpi_header *h = (struct acpi_header *) tables[i];
+		if(memcmp(h->signature, "APIC", 4) || !cpu_checksum(h, h->length))
+			continue;
+
+		/* The MADT header is followed by the APIC address and flags. */
+		uint8_t *e = (uint8_t *) (h + 1) + 8;
+		uint8_t *end = (uint8_t *) h + h->length;
+		while(e + 2 <= end && e[1] >= 2) {
+			struct acpi_madt_lapic *l = (struct acpi_madt_lapic *) e;
+			if(l->type == ACPI_MADT_LAPIC && (l->flags & ACPI_LAPIC_ENABLED))
+				cpu_add(l->apic_id);
+			e += e[1];
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static void cpu_segment(struct x86_segment *s, uint32_t base, uint32_t limit, int type, int stype)
+{
+	memset(s, 0, sizeof(*s));
+	s->limit0 = limit & 0xffff;
+	s->base0 = base & 0xffff;
+	s->base1 = (base >> 16) & 0xff;
+	s->type = type;
+	s->stype = stype;
+	s->dpl = 0;
+	s->present = 1;
+	s->limit1 = (limit >> 16) & 0xf;
+	s->size = stype;
+	s->base2 = base >> 24;
+}
+
+static void cpu_wrmsr(uint32_t msr, uint32_t value)
+{
+	asm volatile("wrmsr"::"a"(value), "d"(0), "c"(msr));
+}
+
+/*
+SYSENTER loads the kernel code segment from the MSR, and the kernel
+stack segment and the user segments from the three entries after it,
+which is the order of the descriptor table.  The stack pointer it
+loads is the top of the processor's own stack, which is not in use
+while user code runs.  The word just above it holds the address of
+esp0 in the TSS, from which intr_sysenter takes the kernel stack of
+whichever process is running.  The boot processor has no stack of
+its own until cpu_start gives it one.
+*/
+
+static void cpu_load_sysenter(struct cpu *c)
+{
+	if(!cpu_sysenter || !c->stack_top)
+		return;
+
+	*(int32_t **) c->stack_top = &c->tss.esp0;
+
+	cpu_wrmsr(MSR_SYSENTER_CS, X86_SEGMENT_KERNEL_CODE);
+	cpu_wrmsr(MSR_SYSENTER_ESP, (uint32_t) c->stack_top);
+	cpu_wrmsr(MSR_SYSENTER_EIP, (uint32_t) intr_sysenter);
+}
+
+/*
+SYSENTER does not clear TF, so a process single stepping into it
+traps on the first instruction of intr_sysenter, on the processor's
+own stack.  Called for each debug exception: if it is that one,
+clear TF in the saved flags and carry on into the kernel.
+*/
+
+int cpu_sysenter_step()
+{
+	uint32_t *frame = (uint32_t *) cpu_self()->stack_top - 3;
+
+	if(!cpu_sysenter || frame[0] != (uint32_t) intr_sysenter)
+		return 0;
+
+	frame[2] &= ~EFLAGS_TF;
+	return 1;
+}
+
+/*
+Give the processor its own copy of the descriptor table, with its
+own TSS and per-processor data segment, and load them.
+*/
+
+static void cpu_load(struct cpu *c)
+{
+	c->self = c;
+
+	memcpy(c->gdt, gdt, 5 * sizeof(struct x86_segment));
+	cpu_segment(&c->gdt[5], (uint32_t) &c->tss, sizeof(c->tss) - 1, 0x9, 0);
+	cpu_segment(&c->gdt[6], (uint32_t) c, sizeof(*c) - 1, 0x2, 1);
+
+	memset(&c->tss, 0, sizeof(c->tss));
+	c->tss.ss0 = X86_SEGMENT_KERNEL_DATA;
+	c->tss.esp0 = (int32_t) c->stack_top;
+	c->tss.iomap = sizeof(c->tss);
+
+	struct x86_gdt_init init;
+	init.size = sizeof(c->gdt) - 1;
+	init.base = c->gdt;
+
+	asm volatile("lgdt %0"::"m"(init));
+	asm volatile("ltr %w0"::"r"(X86_SEGMENT_TSS));
+	asm volatile("movw %w0, %%fs"::"r"(X86_SEGMENT_CPU));
+
+	cpu_load_sysenter(c);
+}
+
+/*
+Called first thing by kernel_main, before anything uses current.
+The boot processor takes the kernel lock, and holds it whenever it
+runs kernel code from then on, like any other processor.
+*/
+
+void cpu_init()
+{
+	uint32_t eax, ebx, ecx, edx;
+	asm("cpuid":"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx):"a"(1));
+
+	/* The earliest Pentium Pro reports SEP without supporting it. */
+	uint32_t signature = eax & 0xfff;
+	cpu_sysenter = (edx & CPUID_FEATURE_SEP) && !(signature >= 0x600 && signature < 0x630 && (signature & 0xf) < 3);
+
+	cpu_table[0].id = 0;
+	cpu_table[0].apic_id = ebx >> 24;
+	cpu_table[0].online = 1;
+	cpu_count = 1;
+
+	if(!cpu_find_mp())
+		cpu_find_acpi();
+
+	cpu_load(&cpu_table[0]);
+	cpu_kernel_enter();
+}
+
+static void cpu_delay(uint32_t us)
+{
+	uint64_t end = clock_read_us() + us;
+	while(clock_read_us() < end) {
+		asm volatile("pause");
+	}
+}
+
+static void cpu_reschedule_interrupt(int i, int code)
+{
+	/* Nothing to do: the switch happens on the way out of the interrupt. */
+}
+
+void cpu_ap_main()
+{
+	struct cpu *c = cpu_boot_cpu;
+
+	cpu_load(c);
+	lapic_init();
+	fpu_init_cpu();
+	c->online = 1;
+
+	cpu_kernel_enter();
+	process_start_cpu();
+}
+
+static int cpu_start_ap(struct cpu *c)
+{
+	memcpy((void *) CPU_TRAMPOLINE_START, cpu_trampoline, cpu_trampoline_end - cpu_trampoline);
+
+	asm volatile("movl %%cr0, %0":"=r"(cpu_boot_cr0));
+	asm volatile("movl %%cr4, %0":"=r"(cpu_boot_cr4));
+	cpu_boot_cr3 = (uint32_t) pagetable_kernel();
+	cpu_boot_stack = c->stack_top;
+	cpu_boot_cpu = c;
+
+	lapic_send_init(c->apic_id);
+	cpu_delay(10000);
+
+	int tries;
+	for(tries = 0; tries < 2; tries++) {
+		lapic_send_startup(c->apic_id, CPU_TRAMPOLINE_START >> 12);
+		uint64_t end = clock_read_us() + (tries ? CPU_STARTUP_TIMEOUT_US : 200);
+		while(clock_read_us() < end) {
+			if(((volatile struct cpu *) c)->online)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+Called once paging, the clock, and the process table are ready:
+give each processor its idle stack, and start the others.
+*/
+
+void cpu_start()
+{
+	int i;
+
+	for(i = 0; i < cpu_count; i++) {
+		struct cpu *c = &cpu_table[i];
+		c->stack = page_alloc_order(CPU_STACK_ORDER, 1);
+		c->stack_top = c->stack + (PAGE_SIZE << CPU_STACK_ORDER) - 16;
+	}
+	cpu_table[0].tss.esp0 = (int32_t) cpu_table[0].stack_top;
+	cpu_load_sysenter(&cpu_table[0]);
+
+	if(!lapic_address()) {
+		cpu_count = 1;
+		return;
+	}
+
+	interrupt_register(INTERRUPT_IPI_RESCHEDULE, cpu_reschedule_interrupt);
+
+	for(i = 1; i < cpu_count; i++) {
+		if(!cpu_start_ap(&cpu_table[i]))
+			printf("cpu: processor %d did not start\n", cpu_table[i].apic_id);
+	}
+
+	printf("cpu: %d of %d processors online\n", cpu_online(), cpu_count);
+}
+
+int cpu_online()
+{
+	int i, n = 0;
+	for(i = 0; i < cpu_count; i++) {
+		if(cpu_table[i].online)
+			n++;
+	}
+	return n;
+}
+
+/*
+Interrupt another processor, so that it notices a process newly
+placed on its ready lists, whether it is idle or running user code.
+*/
+
+void cpu_reschedule(struct cpu *c)
+{
+	if(c != cpu_self() && c->online)
+		lapic_send_ipi(c->apic_id, INTERRUPT_IPI_RESCHEDULE);
+}
+
+/*
+Kernel mappings that are removed may still be cached by other
+processors.  Since they can only use them while holding the kernel
+lock, each one flushes its TLB when it next takes the lock.
+*/
+
+void cpu_tlb_shootdown()
+{
+	tlb_generation++;
+	cpu_self()->tlb_generation = tlb_generation;
+}
+
+static void cpu_kernel_acquire(struct cpu *c)
+{
+	spinlock_acquire(&kernel_lock);
+	if(c->tlb_generation != tlb_generation) {
+		c->tlb_generation = tlb_generation;
+		pagetable_refresh_global();
+	}
+}
+
+/*
+The kernel lock is counted per processor, so that interrupts
+taken while already in the kernel do not take it again.
+It is always taken and released with interrupts blocked.
+*/
+
+void cpu_kernel_enter()
+{
+	struct cpu *c = cpu_self();
+	if(c->lock_depth++ == 0)
+		cpu_kernel_acquire(c);
+}
+
+void cpu_kernel_exit()
+{
+	struct cpu *c = cpu_self();
+	if(--c->lock_depth == 0)
+		spinlock_release(&kernel_lock);
+}
+
+/*
+Release the lock entirely while waiting for an interrupt,
+and return the depth to restore when taking it again.
+*/
+
+int cpu_kernel_release()
+{
+	struct cpu *c = cpu_self();
+	int depth = c->lock_depth;
+	c->lock_depth = 0;
+	if(depth)
+		spinlock_release(&kernel_lock);
+	return depth;
+}
+
+void cpu_kernel_reacquire(int depth)
+{
+	struct cpu *c = cpu_self();
+	if(depth)
+		cpu_kernel_acquire(c);
+	c->lock_depth = depth;
+}
+
+/*
+Let any processor waiting for the lock have it, during long
+stretches of kernel work such as the idle loop.
+*/
+
+void cpu_kernel_yield()
+{
+	if(spinlock_contended(&kernel_lock))
+		cpu_kernel_reacquire(cpu_kernel_release());
+}
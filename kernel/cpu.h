@@ -0,0 +1,82 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef CPU_H
+#define CPU_H
+
+#include "kernel/types.h"
+#include "list.h"
+#include "x86.h"
+
+/*
+Each processor has a struct cpu holding everything that differs
+between processors: the running process, the ready lists, the
+time slice, its own stack for interrupts and idling, and its own
+descriptor table and TSS.  Entry 6 of each descriptor table is a
+data segment covering the processor's own struct cpu, which the
+kernel keeps in %fs, so that cpu_self() is a single load.
+
+All kernel code runs under a single kernel lock, taken on entry
+to the kernel from user mode or from an idle processor, and
+released on the way out.  User code runs on all processors at once.
+The kernel lock is a first step: the process table, the ready lists,
+the block cache and kmalloc still rely on it alone, and are to get
+locks of their own one at a time, as the page allocator already has,
+before the kernel lock can be narrowed.
+*/
+
+#define CPU_MAX 8
+
+#define CPU_SEGMENT_COUNT 7
+#define X86_SEGMENT_CPU   X86_SEGMENT_SELECTOR(6,0)
+
+struct process;
+
+struct cpu {
+	struct cpu *self;
+	int id;
+	uint32_t apic_id;
+	int online;
+	struct process *running;
+	struct process *yielded;
+	int preempt_pending;
+	int lock_depth;
+	uint32_t tlb_generation;
+	struct process *fpu_owner;
+	uint64_t slice_end;
+	char *stack;
+	char *stack_top;
+	struct list ready[PROCESS_PRIORITY_LEVELS];
+	struct x86_segment gdt[CPU_SEGMENT_COUNT];
+	struct x86_tss tss;
+};
+
+extern struct cpu cpu_table[CPU_MAX];
+extern int cpu_count;
+
+static inline struct cpu *cpu_self()
+{
+	struct cpu *c;
+	asm volatile("movl %%fs:0, %0":"=r"(c));
+	return c;
+}
+
+void cpu_init();
+void cpu_start();
+int  cpu_online();
+
+void cpu_kernel_enter();
+void cpu_kernel_exit();
+int  cpu_kernel_release();
+void cpu_kernel_reacquire(int depth);
+void cpu_kernel_yield();
+
+int  cpu_sysenter_step();
+
+void cpu_reschedule(struct cpu *c);
+void cpu_tlb_shootdown();
+
+#endif
@@ -204,6 +204,28 @@ int diskfs_inode_read( struct fs_dirent *d, struct diskfs_block *b, uint32_t blo
 	return diskfs_data_block_read(d->volume,b,actual);
 }
 
+/*
+Return the cache page holding a block of the file, without copying it.
+*/
+
+void *diskfs_inode_map( struct fs_dirent *d, uint32_t block )
+{
+	int actual;
+
+	if(block<DISKFS_DIRECT_POINTERS) {
+		actual = d->disk.direct[block];
+	} else {
+		struct diskfs_block *b = page_alloc(0);
+		if(!b) return 0;
+		diskfs_data_block_read(d->volume,b,d->disk.indirect);
+		actual = b->pointers[block-DISKFS_DIRECT_POINTERS];
+		page_free(b);
+	}
+
+	if(actual>=d->volume->disk.data_blocks) return 0;
+	return bcache_map_block(d->volume->device,d->volume->disk.data_start+actual);
+}
+
 int diskfs_inode_write( struct fs_dirent *d, struct diskfs_block *b, uint32_t block )
 {
 	int actual;
@@ -252,7 +274,7 @@ int diskfs_inode_write( struct fs_dirent *d, struct diskfs_block *b, uint32_t bl
 
 struct fs_dirent * diskfs_dirent_create( struct fs_volume *volume, int inumber, int type )
 {
-	struct fs_dirent *d = kmalloc(sizeof(*d));
+	struct fs_dirent *d = fs_dirent_alloc();
 	memset(d,0,sizeof(*d));
 
 	diskfs_inode_load(volume,inumber,&d->disk);
@@ -640,6 +662,7 @@ struct fs_ops diskfs_ops = {
 	.mkdir = diskfs_dirent_create_dir,
 	.mkfile = diskfs_dirent_create_file,
 	.read_block = diskfs_dirent_read_block,
+	.map_block = diskfs_inode_map,
 	.write_block = diskfs_dirent_write_block,
 	.list = diskfs_dirent_list,
 	.remove = diskfs_dirent_remove,
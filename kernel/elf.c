@@ -205,7 +205,7 @@ static int load_raw(struct process *p, struct fs_dirent *d, addr_t *entry)
     actual = fs_dirent_read(d, (char *)PROCESS_ENTRY_POINT, file_size, 0);
     if (actual != file_size) {
         printf("bin: load failed\n");
-        return -1;
+        return KERROR_EXECUTION_FAILED;
     }
 
     /* Check if this is a system app and patch it */
@@ -289,6 +289,40 @@ static int load_elf(struct process *p, struct fs_dirent *d, addr_t *entry)
         return -1;
     }
 
+    /*
+     * Check every segment before touching the old image, so that
+     * a bad file leaves the caller's program intact.  Each segment
+     * must lie within the data area, below the mapped file area.
+     */
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        if (phdrs[i].p_type != PT_LOAD)
+            continue;
+
+        if (phdrs[i].p_vaddr < PROCESS_ENTRY_POINT ||
+            phdrs[i].p_vaddr >= PROCESS_MAP_START ||
+            phdrs[i].p_memsz > PROCESS_MAP_START - phdrs[i].p_vaddr ||
+            phdrs[i].p_filesz > phdrs[i].p_memsz) {
+            kfree(phdrs);
+            printf("bin: segment outside user space\n");
+            return -1;
+        }
+    }
+
+    if (bin_interrupted) {
+        kfree(phdrs);
+        printf("\nbin: interrupted during load\n");
+        return -1;
+    }
+
+    /*
+     * Start from an empty data segment, so that every page of the
+     * new image is a fresh demand-zero page rather than a leftover
+     * from a previous image.  From here on the old image is gone,
+     * so a failure must not return to it: KERROR_EXECUTION_FAILED
+     * tells the caller to kill the process instead.
+     */
+    process_data_size_set(p, 0);
+
     for (int i = 0; i < ehdr.e_phnum; i++) {
         if (phdrs[i].p_type != PT_LOAD)
             continue;
@@ -296,15 +330,16 @@ static int load_elf(struct process *p, struct fs_dirent *d, addr_t *entry)
         if (bin_interrupted) {
             kfree(phdrs);
             printf("\nbin: interrupted during load\n");
-            return -1;
+            return KERROR_EXECUTION_FAILED;
         }
 
-        uint32_t max_addr = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+        /* The data segment size is measured from the start of user space. */
+        uint32_t max_addr = phdrs[i].p_vaddr + phdrs[i].p_memsz - PROCESS_ENTRY_POINT;
         if (max_addr > p->vm_data_size) {
             if (process_data_size_set(p, max_addr) != 0) {
                 kfree(phdrs);
                 printf("bin: out of memory\n");
-                return -1;
+                return KERROR_EXECUTION_FAILED;
             }
         }
 
@@ -316,15 +351,22 @@ static int load_elf(struct process *p, struct fs_dirent *d, addr_t *entry)
             if (actual != phdrs[i].p_filesz) {
                 kfree(phdrs);
                 printf("bin: segment read failed\n");
-                return -1;
+                return KERROR_EXECUTION_FAILED;
             }
         }
 
-        /* Zero BSS region (memsz > filesz) */
+        /*
+         * Zero BSS region (memsz > filesz).  Only the tail of the page
+         * holding the end of the file data needs clearing: the pages
+         * beyond it are demand-zero and are cleared on first touch.
+         */
         if (phdrs[i].p_memsz > phdrs[i].p_filesz) {
-            memset((char *)(phdrs[i].p_vaddr + phdrs[i].p_filesz),
-                   0,
-                   phdrs[i].p_memsz - phdrs[i].p_filesz);
+            uint32_t bss_start = phdrs[i].p_vaddr + phdrs[i].p_filesz;
+            uint32_t bss_end = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+            uint32_t page_end = (bss_start + PAGE_SIZE - 1) & PAGE_MASK;
+            if (bss_end > page_end)
+                bss_end = page_end;
+            memset((char *)bss_start, 0, bss_end - bss_start);
         }
     }
 
@@ -37,7 +37,7 @@ void event_post( uint16_t type, uint16_t code, int16_t x, int16_t y )
 
 	/* Advance head pointer and wake up waiting process (if any) */
 	head = next;
-	process_wakeup(&queue);
+	process_wakeup_input(&queue);
 }
 
 int event_read_raw( struct event *e, int size, int blocking )
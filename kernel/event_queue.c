@@ -50,7 +50,7 @@ void event_queue_post( struct event_queue *q, struct event *e )
 
 	/* Advance head pointer and wake up waiting process (if any) */
 	q->head = next;
-	process_wakeup(&q->process_queue);
+	process_wakeup_input(&q->process_queue);
 }
 
 /* INTERRUPT CONTEXT */
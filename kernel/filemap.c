@@ -0,0 +1,163 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "filemap.h"
+#include "process.h"
+#include "pagetable.h"
+#include "page.h"
+#include "slab.h"
+#include "memorylayout.h"
+#include "kernel/error.h"
+
+static struct slab_cache filemap_cache = SLAB_CACHE_INIT("filemap", sizeof(struct filemap), 0);
+
+static struct filemap *filemap_lookup(struct process *p, uint32_t vaddr)
+{
+	struct list_node *n;
+
+	for(n = p->filemap_list.head; n; n = n->next) {
+		struct filemap *m = (struct filemap *) n;
+		if(vaddr >= m->vaddr && vaddr - m->vaddr < m->length)
+			return m;
+	}
+
+	return 0;
+}
+
+/*
+Find the lowest free range of the given length in the map area,
+by moving past each existing map that overlaps the candidate range.
+*/
+
+static uint32_t filemap_place(struct process *p, uint32_t length)
+{
+	struct list_node *n;
+	uint32_t vaddr = PROCESS_MAP_START;
+
+	restart:
+	if(length > PROCESS_MAP_END - vaddr)
+		return 0;
+
+	for(n = p->filemap_list.head; n; n = n->next) {
+		struct filemap *m = (struct filemap *) n;
+		if(vaddr < m->vaddr + m->length && m->vaddr < vaddr + length) {
+			vaddr = m->vaddr + m->length;
+			goto restart;
+		}
+	}
+
+	return vaddr;
+}
+
+int filemap_create(struct process *p, struct fs_dirent *d, uint32_t offset, uint32_t length, uint32_t *vaddr)
+{
+	uint32_t size = fs_dirent_size(d);
+
+	if(fs_dirent_isdir(d))
+		return KERROR_NOT_A_FILE;
+	if(offset % PAGE_SIZE || offset >= size)
+		return KERROR_INVALID_REQUEST;
+
+	if(length == 0 || length > size - offset)
+		length = size - offset;
+	if(length % PAGE_SIZE)
+		length += PAGE_SIZE - length % PAGE_SIZE;
+
+	uint32_t start = filemap_place(p, length);
+	if(!start)
+		return KERROR_OUT_OF_SPACE;
+
+	struct filemap *m = slab_alloc(&filemap_cache);
+	if(!m)
+		return KERROR_OUT_OF_MEMORY;
+
+	m->vaddr = start;
+	m->length = length;
+	m->offset = offset;
+	m->file = fs_dirent_addref(d);
+	list_push_tail(&p->filemap_list, &m->node);
+
+	*vaddr = start;
+	return 0;
+}
+
+static void filemap_release(struct process *p, struct filemap *m)
+{
+	list_remove(&m->node);
+	pagetable_free(p->pagetable, m->vaddr, m->length);
+	fs_dirent_close(m->file);
+	slab_free(&filemap_cache, m);
+}
+
+int filemap_delete(struct process *p, uint32_t vaddr)
+{
+	struct filemap *m = filemap_lookup(p, vaddr);
+	if(!m || m->vaddr != vaddr)
+		return KERROR_INVALID_ADDRESS;
+
+	filemap_release(p, m);
+	return 0;
+}
+
+void filemap_delete_all(struct process *p)
+{
+	while(p->filemap_list.head) {
+		filemap_release(p, (struct filemap *) p->filemap_list.head);
+	}
+}
+
+/*
+Give the child of a fork the same maps as its parent.
+Pages already faulted in were shared by pagetable_duplicate,
+so only the records are copied here.
+*/
+
+int filemap_copy(struct process *parent, struct process *child)
+{
+	struct list_node *n;
+
+	for(n = parent->filemap_list.head; n; n = n->next) {
+		struct filemap *m = (struct filemap *) n;
+		struct filemap *c = slab_alloc(&filemap_cache);
+		if(!c)
+			return KERROR_OUT_OF_MEMORY;
+		c->vaddr = m->vaddr;
+		c->length = m->length;
+		c->offset = m->offset;
+		c->file = fs_dirent_addref(m->file);
+		list_push_tail(&child->filemap_list, &c->node);
+	}
+
+	return 0;
+}
+
+/*
+Resolve a fault within a filemap by mapping the page of the file
+that belongs there.  The page comes from fs_dirent_map_page,
+which shares the block cache's own page where it can, and the
+reference it returns is handed over to the page table.
+Returns 1 if vaddr is within a map and the page is now mapped.
+*/
+
+int filemap_fault(struct process *p, uint32_t vaddr)
+{
+	struct filemap *m = filemap_lookup(p, vaddr);
+	if(!m)
+		return 0;
+
+	vaddr &= PAGE_MASK;
+
+	void *page = fs_dirent_map_page(m->file, m->offset + (vaddr - m->vaddr));
+	if(!page)
+		return 0;
+
+	if(!pagetable_map(p->pagetable, vaddr, (unsigned) page, PAGE_FLAG_USER | PAGE_FLAG_COW)) {
+		page_free(page);
+		return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,37 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef FILEMAP_H
+#define FILEMAP_H
+
+#include "kernel/types.h"
+#include "list.h"
+#include "fs.h"
+
+struct process;
+
+/*
+A filemap is a range of a process' address space backed by a file.
+Nothing is read when the map is created: each page is faulted in
+on first access by filemap_fault, mapped read-only and copy-on-write,
+so that the process may write to its private copy of the data.
+*/
+
+struct filemap {
+	struct list_node node;
+	uint32_t vaddr;
+	uint32_t length;
+	uint32_t offset;
+	struct fs_dirent *file;
+};
+
+int  filemap_create(struct process *p, struct fs_dirent *d, uint32_t offset, uint32_t length, uint32_t *vaddr);
+int  filemap_delete(struct process *p, uint32_t vaddr);
+void filemap_delete_all(struct process *p);
+int  filemap_copy(struct process *parent, struct process *child);
+int  filemap_fault(struct process *p, uint32_t vaddr);
+
+#endif
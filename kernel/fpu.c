@@ -0,0 +1,231 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "fpu.h"
+#include "cpu.h"
+#include "process.h"
+#include "interrupt.h"
+#include "slab.h"
+#include "string.h"
+#include "console.h"
+
+#define CPUID_FEATURE_FPU  (1<<0)
+#define CPUID_FEATURE_FXSR (1<<24)
+#define CPUID_FEATURE_SSE  (1<<25)
+
+#define CR0_MP (1<<1)
+#define CR0_EM (1<<2)
+#define CR0_TS (1<<3)
+#define CR0_NE (1<<5)
+
+#define CR4_OSFXSR     (1<<9)
+#define CR4_OSXMMEXCPT (1<<10)
+
+#define INTERRUPT_FPU_UNAVAILABLE 7
+
+/*
+FXSAVE needs a 16 byte aligned area, which the slab allocator
+does not promise, so each area is allocated with room to spare
+and the aligned part of it is used.
+*/
+
+#define FPU_AREA_SIZE (FPU_STATE_SIZE + 16)
+#define FPU_ALIGN(a) ((char *) (((uint32_t) (a) + 15) & ~15))
+
+static struct slab_cache fpu_cache = SLAB_CACHE_INIT("fpu", FPU_AREA_SIZE, 0);
+
+static int fpu_fxsr = 0;
+static int fpu_present = 0;
+
+static void fpu_set_ts()
+{
+	uint32_t cr0;
+	asm volatile("movl %%cr0, %0":"=r"(cr0));
+	if(!(cr0 & CR0_TS))
+		asm volatile("movl %0, %%cr0"::"r"(cr0 | CR0_TS));
+}
+
+static int fpu_ts_set()
+{
+	uint32_t cr0;
+	asm volatile("movl %%cr0, %0":"=r"(cr0));
+	return (cr0 & CR0_TS) != 0;
+}
+
+static void fpu_save(char *state)
+{
+	if(fpu_fxsr)
+		asm volatile("fxsave (%0)"::"r"(state):"memory");
+	else
+		asm volatile("fnsave (%0); fwait"::"r"(state):"memory");
+}
+
+static void fpu_restore(char *state)
+{
+	if(fpu_fxsr)
+		asm volatile("fxrstor (%0)"::"r"(state):"memory");
+	else
+		asm volatile("frstor (%0)"::"r"(state):"memory");
+}
+
+/*
+Exception 7: give the FPU to the current process, loading its state,
+or a clean state if it has never used the FPU before.  The state of
+any previous owner was already saved when that owner switched out.
+*/
+
+static void fpu_unavailable(int i, int code)
+{
+	struct cpu *c = cpu_self();
+	struct process *p = current;
+
+	asm volatile("clts");
+
+	if(!p)
+		return;
+
+	if(!p->fpu_area) {
+		p->fpu_area = slab_alloc(&fpu_cache);
+		if(!p->fpu_area) {
+			printf("fpu: no memory for the state of process %d\n", p->pid);
+			process_kill(p->pid);
+			return;
+		}
+		asm volatile("fninit");
+		fpu_save(FPU_ALIGN(p->fpu_area));
+	} else {
+		fpu_restore(FPU_ALIGN(p->fpu_area));
+	}
+
+	c->fpu_owner = p;
+	p->fpu_cpu = c;
+	p->stats.fpu_loads++;
+}
+
+/*
+Called on each processor as it starts, to let user code use the
+FPU and, where the processor has them, SSE instructions.
+*/
+
+void fpu_init_cpu()
+{
+	uint32_t cr0, cr4;
+
+	if(!fpu_present)
+		return;
+
+	asm volatile("movl %%cr0, %0":"=r"(cr0));
+	cr0 &= ~(CR0_EM | CR0_TS);
+	cr0 |= CR0_MP | CR0_NE;
+	asm volatile("movl %0, %%cr0"::"r"(cr0));
+
+	if(fpu_fxsr) {
+		asm volatile("movl %%cr4, %0":"=r"(cr4));
+		cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+		asm volatile("movl %0, %%cr4"::"r"(cr4));
+	}
+
+	asm volatile("fninit");
+	cpu_self()->fpu_owner = 0;
+}
+
+void fpu_init()
+{
+	uint32_t eax, ebx, ecx, edx;
+	asm("cpuid":"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx):"a"(1));
+
+	fpu_present = (edx & CPUID_FEATURE_FPU) != 0;
+	fpu_fxsr = (edx & CPUID_FEATURE_FXSR) != 0;
+
+	if(!fpu_present) {
+		printf("fpu: none\n");
+		return;
+	}
+
+	interrupt_register(INTERRUPT_FPU_UNAVAILABLE, fpu_unavailable);
+	fpu_init_cpu();
+
+	printf("fpu: x87%s, switched lazily\n", (edx & CPUID_FEATURE_SSE) && fpu_fxsr ? " and sse" : "");
+}
+
+/*
+Called by process_switch as the running process gives up the
+processor.  If TS is clear, the process has used the FPU since
+it was switched in, so its registers are saved.
+*/
+
+void fpu_switch_out(struct process *p)
+{
+	if(!fpu_present)
+		return;
+
+	if(!fpu_ts_set()) {
+		if(p->fpu_area && cpu_self()->fpu_owner == p)
+			fpu_save(FPU_ALIGN(p->fpu_area));
+		fpu_set_ts();
+	}
+}
+
+/*
+Called as a process is given the processor.  Clear TS only if
+the registers on this processor still hold the process's state.
+*/
+
+void fpu_switch_in(struct cpu *c, struct process *p)
+{
+	if(!fpu_present)
+		return;
+
+	if(c->fpu_owner == p && p->fpu_cpu == c) {
+		asm volatile("clts");
+	} else {
+		fpu_set_ts();
+	}
+}
+
+/*
+A forked child starts with a copy of its parent's FPU state,
+saving the parent's registers first if they are newer.
+*/
+
+void fpu_copy(struct process *parent, struct process *child)
+{
+	if(!parent->fpu_area)
+		return;
+
+	child->fpu_area = slab_alloc(&fpu_cache);
+	if(!child->fpu_area)
+		return;
+
+	if(!fpu_ts_set() && cpu_self()->fpu_owner == parent)
+		fpu_save(FPU_ALIGN(parent->fpu_area));
+
+	memcpy(FPU_ALIGN(child->fpu_area), FPU_ALIGN(parent->fpu_area), FPU_STATE_SIZE);
+}
+
+/*
+Discard the state of a process that is exiting or starting a new
+program, making sure no processor still believes it holds it.
+*/
+
+void fpu_release(struct process *p)
+{
+	int i;
+
+	for(i = 0; i < cpu_count; i++) {
+		if(cpu_table[i].fpu_owner == p)
+			cpu_table[i].fpu_owner = 0;
+	}
+
+	if(p == current)
+		fpu_set_ts();
+
+	if(p->fpu_area) {
+		slab_free(&fpu_cache, p->fpu_area);
+		p->fpu_area = 0;
+	}
+	p->fpu_cpu = 0;
+}
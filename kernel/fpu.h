@@ -0,0 +1,40 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef FPU_H
+#define FPU_H
+
+#include "kernel/types.h"
+
+/*
+The x87 and SSE registers are switched lazily.  Each processor
+sets CR0.TS whenever it switches processes, so that the first
+floating point or SSE instruction a process executes traps with
+exception 7, and only then is its state loaded.  A process that
+never touches the FPU never has any state to save or load.
+
+A process that has used the FPU since it was switched in has its
+state saved into its FXSAVE area when it is switched out.  If it
+next runs on the same processor, and no other process has used the
+FPU there meanwhile, the registers still hold its state, so TS is
+left clear and no trap or reload is needed at all.
+*/
+
+#define FPU_STATE_SIZE 512
+
+struct process;
+struct cpu;
+
+void fpu_init();
+void fpu_init_cpu();
+
+void fpu_switch_out(struct process *p);
+void fpu_switch_in(struct cpu *c, struct process *p);
+
+void fpu_copy(struct process *parent, struct process *child);
+void fpu_release(struct process *p);
+
+#endif
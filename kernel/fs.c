@@ -7,6 +7,7 @@ See the file LICENSE for details.
 #include "fs.h"
 #include "fs_internal.h"
 #include "kmalloc.h"
+#include "slab.h"
 #include "string.h"
 #include "page.h"
 #include "process.h"
@@ -225,6 +226,13 @@ struct fs_dirent *fs_dirent_traverse(struct fs_dirent *parent, const char *path)
 	return d;
 }
 
+static struct slab_cache fs_dirent_cache = SLAB_CACHE_INIT("fs_dirent", sizeof(struct fs_dirent), 0);
+
+struct fs_dirent *fs_dirent_alloc()
+{
+	return slab_alloc(&fs_dirent_cache);
+}
+
 struct fs_dirent *fs_dirent_addref(struct fs_dirent *d)
 {
 	d->refcount++;
@@ -242,7 +250,7 @@ int fs_dirent_close(struct fs_dirent *d)
 		ops->close(d);
 		// This close is paired with the addref in fs_dirent_lookup
 		fs_volume_close(d->volume);
-		kfree(d);
+		slab_free(&fs_dirent_cache, d);
 	}
 
 	return 0;
@@ -308,6 +316,43 @@ int fs_dirent_read(struct fs_dirent *d, char *buffer, uint32_t length, uint32_t
 	return total;
 }
 
+/*
+Return a page holding the file data at offset, which must be page aligned.
+The caller gets a reference to the page, and releases it with page_free.
+Where the filesystem can map a whole page sized block, this is the
+block cache's own page, shared without copying.  Otherwise, and for
+the last partial page of the file, the data is read into a new page
+so that anything beyond the end of the file reads as zero.
+*/
+
+void *fs_dirent_map_page(struct fs_dirent *d, uint32_t offset)
+{
+	int bs = d->volume->block_size;
+	const struct fs_ops *ops = d->volume->fs->ops;
+
+	if(offset >= d->size)
+		return 0;
+
+	uint32_t length = MIN(PAGE_SIZE, d->size - offset);
+
+	if(ops->map_block && bs == PAGE_SIZE && length == PAGE_SIZE) {
+		void *page = ops->map_block(d, offset / bs);
+		if(page)
+			return page;
+	}
+
+	char *page = page_alloc(1);
+	if(!page)
+		return 0;
+
+	if(fs_dirent_read(d, page, length, offset) != length) {
+		page_free(page);
+		return 0;
+	}
+
+	return page;
+}
+
 struct fs_dirent * fs_dirent_mkdir(struct fs_dirent *d, const char *name)
 {
 	const struct fs_ops *ops = d->volume->fs->ops;
@@ -40,6 +40,8 @@ struct fs_dirent {
 	};
 };
 
+struct fs_dirent *fs_dirent_alloc();
+
 struct fs_ops {
 	struct fs_dirent *(*volume_root) (struct fs_volume *v);
 	struct fs_volume *(*volume_open) (struct device *d);
@@ -51,6 +53,7 @@ struct fs_ops {
 	struct fs_dirent * (*mkfile) (struct fs_dirent *d, const char *name);
 
 	int (*read_block) (struct fs_dirent *d, char *buffer, uint32_t blocknum);
+	void * (*map_block) (struct fs_dirent *d, uint32_t blocknum);
 	int (*write_block) (struct fs_dirent *d, const char *buffer, uint32_t blocknum);
 	int (*list) (struct fs_dirent *d, char *buffer, int buffer_length);
 	int (*remove) (struct fs_dirent *d, const char *name);
@@ -7,15 +7,20 @@ See the file LICENSE for details.
 #include "interrupt.h"
 #include "console.h"
 #include "pic.h"
+#include "lapic.h"
 #include "process.h"
 #include "kernelcore.h"
 #include "x86.h"
 #include "graphics.h"
 #include "ioports.h"
+#include "memorylayout.h"
+#include "filemap.h"
+#include "swap.h"
+#include "cpu.h"
 
-static interrupt_handler_t interrupt_handler_table[48];
-static uint32_t interrupt_count[48];
-static uint8_t interrupt_spurious[48];
+static interrupt_handler_t interrupt_handler_table[INTERRUPT_MAX];
+static uint32_t interrupt_count[INTERRUPT_MAX];
+static uint8_t interrupt_spurious[INTERRUPT_MAX];
 
 static const char *exception_names[] = {
 	"division by zero",
@@ -69,11 +74,38 @@ static void unknown_exception(int i, int code)
 	unsigned paddr; // physical address
 	unsigned esp; // stack pointer
 
+	// A process single stepping into SYSENTER traps in the kernel.
+	if(i==1 && cpu_sysenter_step())
+		return;
+
 	if(i==14) {
 		asm("mov %%cr2, %0" : "=r" (vaddr) ); // virtual address trying to be accessed		
+
+		// A write to a present page may be a write to a page shared copy-on-write by fork.
+		if((code & 0x3) == 0x3 && pagetable_cow_fault(current->pagetable, vaddr))
+			return;
+
+		// A reserved page of the data or stack segment is being touched for the first time.
+		if(pagetable_demand_fault(current->pagetable, vaddr))
+			return;
+
+		// A page moved to the compressed store under memory pressure is being touched again.
+		if(pagetable_zram_fault(current->pagetable, vaddr)) {
+			current->stats.zram_faults++;
+			return;
+		}
+
+		// A page written out to the swap area is being touched again.
+		if(swap_fault(current, vaddr))
+			return;
+
+		// A page of a mapped file is being touched for the first time.
+		if(filemap_fault(current, vaddr))
+			return;
+
 		esp  = ((struct x86_stack *)(current->kstack_top - sizeof(struct x86_stack)))->esp; // stack pointer of the process that raised the exception
 		// Check if the requested memory is in the stack or data
-		int data_access = vaddr < current->vm_data_size;
+		int data_access = vaddr >= PROCESS_ENTRY_POINT && vaddr < PROCESS_ENTRY_POINT + current->vm_data_size;
 
 		// Subtract 128 from esp because of the red-zone 
 		// According to https:gcc.gnu.org, the red zone is a 128-byte area beyond 
@@ -90,9 +122,14 @@ static void unknown_exception(int i, int code)
 			printf("interrupt: illegal page access at vaddr %x\n",vaddr);
 			process_dump(current);
 		} else {
-			// XXX update process->vm_stack_size when growing the stack.
-			pagetable_alloc(current->pagetable, vaddr, PAGE_SIZE, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
-			return;
+			if(stack_access) {
+				// Grow the stack segment down to cover vaddr.
+				process_stack_size_set(current, -(vaddr & PAGE_MASK));
+			} else {
+				pagetable_reserve(current->pagetable, vaddr, PAGE_SIZE, PAGE_FLAG_USER | PAGE_FLAG_READWRITE);
+			}
+			if(pagetable_demand_fault(current->pagetable, vaddr))
+				return;
 		}
 	} else {
 		// SAFEGUARD: If a user process crashes, kill it instead of panicking the kernel.
@@ -182,7 +219,7 @@ static void interrupt_acknowledge(int i)
 {
 	if(i < 32) {
 		/* do nothing */
-	} else {
+	} else if(i < INTERRUPT_SYSCALL) {
 		pic_acknowledge(i - 32);
 	}
 }
@@ -200,7 +237,7 @@ void interrupt_init()
 		interrupt_spurious[i] = 0;
 		interrupt_count[i] = 0;
 	}
-	for(i = 32; i < 48; i++) {
+	for(i = 32; i < INTERRUPT_MAX; i++) {
 		interrupt_handler_table[i] = unknown_hardware;
 		interrupt_spurious[i] = 0;
 		interrupt_count[i] = 0;
@@ -212,6 +249,11 @@ void interrupt_init()
 
 void interrupt_handler(int i, int code)
 {
+	// The handler may switch to another process, and the local APIC
+	// will not deliver another interrupt until this one is acknowledged.
+	if(i > INTERRUPT_SYSCALL && i != INTERRUPT_LAPIC_SPURIOUS)
+		lapic_eoi();
+
 	(interrupt_handler_table[i]) (i, code);
 	interrupt_acknowledge(i);
 	interrupt_count[i]++;
@@ -221,7 +263,7 @@ void interrupt_enable(int i)
 {
 	if(i < 32) {
 		/* do nothing */
-	} else {
+	} else if(i < INTERRUPT_SYSCALL) {
 		pic_enable(i - 32);
 	}
 }
@@ -230,7 +272,7 @@ void interrupt_disable(int i)
 {
 	if(i < 32) {
 		/* do nothing */
-	} else {
+	} else if(i < INTERRUPT_SYSCALL) {
 		pic_disable(i - 32);
 	}
 }
@@ -245,8 +287,19 @@ void interrupt_unblock()
 	asm("sti");
 }
 
+/*
+Wait for the next interrupt without holding the kernel lock,
+so that other processors may run kernel code meanwhile.
+sti delays interrupts until after the following hlt, so one
+arriving just before cannot be missed.
+*/
+
 void interrupt_wait()
 {
+	int depth = cpu_kernel_release();
 	asm("sti");
 	asm("hlt");
+	asm("cli");
+	cpu_kernel_reacquire(depth);
+	asm("sti");
 }
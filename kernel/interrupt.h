@@ -36,7 +36,19 @@ IRQ	Interrupt
 13	45	FPU
 14	46	ATA 0
 15	47	ATA 1
+
+Interrupt 48 is the system call.  Interrupts 49 through 63 are
+raised by the local APIC, or sent by other processors through it,
+and are acknowledged to it, not the PIC.
+The spurious vector has the low four bits set, as older
+processors require.
 */
 
+#define INTERRUPT_SYSCALL         48
+#define INTERRUPT_LAPIC_TIMER     49
+#define INTERRUPT_IPI_RESCHEDULE  50
+#define INTERRUPT_LAPIC_SPURIOUS  63
+#define INTERRUPT_MAX             64
+
 
 #endif
@@ -22,6 +22,9 @@ extern void reboot();
 
 extern void intr_return();
 
+struct pagetable;
+extern void process_resume(struct pagetable *p, char *kstack_ptr);
+
 extern void *interrupt_stack_pointer;
 
 #endif
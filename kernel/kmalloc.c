@@ -6,13 +6,40 @@ See the file LICENSE for details.
 
 #include "kmalloc.h"
 #include "console.h"
+#include "clock.h"
 #include "kernel/types.h"
 #include "memorylayout.h"
+#include "allocprof.h"
+#include "vmalloc.h"
+
+/*
+The kernel heap is a sequence of chunks laid end to end.
+Each chunk begins with a header and ends with a footer
+(a "boundary tag") that both record the state and length
+of the chunk, so that the neighbors on either side of a chunk
+can be found in constant time when it is freed.
+
+Free chunks are kept on segregated free lists, one for each
+power of two: list i holds free chunks whose length is in
+the range [2^i,2^(i+1)).  A bitmap records which lists are
+non-empty, so that a chunk large enough for any request can be
+found with a single bit scan instead of a walk over the heap.
+
+When the kmalloc area is exhausted, the heap grows by an arena
+of pages from vmalloc().  An arena holds chunks just like the main
+heap, but is bracketed by two fence chunks that are never free,
+so that merging stops at its edges.  The leading fence also links
+the arenas together.  When a kfree leaves an arena holding nothing
+but a single free chunk, the arena is given back with vfree().
+*/
 
 #define KUNIT sizeof(struct kmalloc_chunk)
 
 #define KMALLOC_STATE_FREE 0xa1a1a1a1
 #define KMALLOC_STATE_USED 0xbfbfbfbf
+#define KMALLOC_STATE_FENCE 0xfefefefe
+
+#define KMALLOC_CLASSES 32
 
 struct kmalloc_chunk {
 	int state;
@@ -21,16 +48,105 @@ struct kmalloc_chunk {
 	struct kmalloc_chunk *prev;
 };
 
+struct kmalloc_tag {
+	int state;
+	int length;
+};
+
+#define KTAG sizeof(struct kmalloc_tag)
+
+// the smallest chunk worth splitting off: a header, a footer, and one unit of data
+#define KMALLOC_MIN_CHUNK (2 * KUNIT)
+
 static struct kmalloc_chunk *head = 0;
+static char *heap_end = 0;
+
+// the leading fence is a whole chunk with a footer, the trailing fence only a header
+#define KMALLOC_FENCE (2 * KUNIT)
+#define KMALLOC_ARENA_SIZE 0x100000
+
+static struct kmalloc_chunk *arenas = 0;
+
+static struct kmalloc_chunk *free_lists[KMALLOC_CLASSES];
+static uint32_t free_lists_bitmap = 0;
+
+static int kmalloc_class(int length)
+{
+	int i = 0;
+	while(length >>= 1)
+		i++;
+	return i;
+}
+
+static struct kmalloc_tag *kmalloc_footer(struct kmalloc_chunk *c)
+{
+	return (struct kmalloc_tag *) ((char *) c + c->length - KTAG);
+}
+
+static void kmalloc_set_state(struct kmalloc_chunk *c, int state)
+{
+	struct kmalloc_tag *t = kmalloc_footer(c);
+	c->state = t->state = state;
+	t->length = c->length;
+}
+
+static void kmalloc_list_insert(struct kmalloc_chunk *c)
+{
+	int i = kmalloc_class(c->length);
+
+	c->prev = 0;
+	c->next = free_lists[i];
+	if(c->next)
+		c->next->prev = c;
+	free_lists[i] = c;
+	free_lists_bitmap |= (1 << i);
+}
+
+static void kmalloc_list_remove(struct kmalloc_chunk *c)
+{
+	int i = kmalloc_class(c->length);
+
+	if(c->prev) {
+		c->prev->next = c->next;
+	} else {
+		free_lists[i] = c->next;
+	}
+	if(c->next)
+		c->next->prev = c->prev;
+	if(!free_lists[i])
+		free_lists_bitmap &= ~(1 << i);
+
+	c->next = c->prev = 0;
+}
+
+/*
+Return the chunk physically following or preceding c,
+or null if c is at the corresponding end of the heap.
+*/
+
+static struct kmalloc_chunk *kmalloc_after(struct kmalloc_chunk *c)
+{
+	char *n = (char *) c + c->length;
+	return n != heap_end ? (struct kmalloc_chunk *) n : 0;
+}
+
+static struct kmalloc_chunk *kmalloc_before(struct kmalloc_chunk *c)
+{
+	if(c == head)
+		return 0;
+	struct kmalloc_tag *t = (struct kmalloc_tag *) ((char *) c - KTAG);
+	return (struct kmalloc_chunk *) ((char *) c - t->length);
+}
 
 /*
-Initialize the linked list by creating a single chunk at
-a given start address and length.  The chunk is initially
-free and has no next or previous chunks.
+Initialize the heap by creating a single free chunk at
+a given start address and length.
 */
 
 void kmalloc_init(char *start, int length)
 {
+	int i;
+
 	// Ensure the memory is actually accessible before initializing
 	volatile char *probe = start;
 	*probe = 0x55;
@@ -49,100 +165,157 @@ void kmalloc_init(char *start, int length)
 	}
 	*probe = save;
 
+	for(i = 0; i < KMALLOC_CLASSES; i++) {
+		free_lists[i] = 0;
+	}
+	free_lists_bitmap = 0;
+
+	length -= length % KUNIT;
+
 	head = (struct kmalloc_chunk *) start;
-	head->state = KMALLOC_STATE_FREE;
+	heap_end = start + length;
 	head->length = length;
-	head->next = 0;
-	head->prev = 0;
+	kmalloc_set_state(head, KMALLOC_STATE_FREE);
+	kmalloc_list_insert(head);
 }
 
 /*
 Split a large chunk into two, such that the current chunk
-has the desired length, and the next chunk has the remainder.
+has the desired length, and the remainder becomes a new
+free chunk on the appropriate free list.
 */
 
 static void ksplit(struct kmalloc_chunk *c, int length)
 {
 	struct kmalloc_chunk *n = (struct kmalloc_chunk *) ((char *) c + length);
 
-	n->state = KMALLOC_STATE_FREE;
 	n->length = c->length - length;
-	n->prev = c;
-	n->next = c->next;
-
-	if(c->next)
-		c->next->prev = n;
+	kmalloc_set_state(n, KMALLOC_STATE_FREE);
+	kmalloc_list_insert(n);
 
-	c->next = n;
 	c->length = length;
 }
 
 /*
-Allocate a chunk of memory of the given length.
-To avoid fragmentation, round up the length to
-a multiple of the chunk size.  Then, search fo
-a chunk of the desired size, and split it if necessary.
+Find a free chunk of at least the given length.
+The list of the request's own class is checked first,
+since its head may be a close fit.  Otherwise, every chunk
+in the next non-empty larger class is large enough,
+and the bitmap gives us that class directly.
 */
 
-void *kmalloc(int length)
+static struct kmalloc_chunk *kmalloc_find(int length)
 {
-	// round up length to a multiple of KUNIT
-	int extra = length % KUNIT;
-	if(extra)
-		length += (KUNIT - extra);
+	int i = kmalloc_class(length);
 
-	// then add one more unit to accommodate the chunk header
-	length += KUNIT;
+	if(free_lists[i] && free_lists[i]->length >= length)
+		return free_lists[i];
 
-	struct kmalloc_chunk *c = head;
+	if(i + 1 >= KMALLOC_CLASSES)
+		return 0;
 
-	while(1) {
-		if(!c) {
-			printf("kmalloc: out of memory!\n");
-			return 0;
-		}
-		if(c->state == KMALLOC_STATE_FREE && c->length >= length)
-			break;
-		c = c->next;
-	}
+	uint32_t mask = free_lists_bitmap & ~((2u << i) - 1);
+	if(!mask)
+		return 0;
 
-	// split the chunk if the remainder is greater than two units
-	if((c->length-length) > 2 * KUNIT) {
-		ksplit(c, length);
-	}
+	return free_lists[__builtin_ctz(mask)];
+}
 
-	c->state = KMALLOC_STATE_USED;
+/*
+Add an arena large enough for a chunk of the given length,
+and return the free chunk that spans it.
+*/
 
-	// return a pointer to the memory following the chunk header
-	return (c + 1);
+static struct kmalloc_chunk *kmalloc_grow(int length)
+{
+	int size = MAX(KMALLOC_ARENA_SIZE, length + KMALLOC_FENCE + KUNIT);
+	size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+
+	char *base = vmalloc(size);
+	if(!base)
+		return 0;
+
+	struct kmalloc_chunk *fence = (struct kmalloc_chunk *) base;
+	fence->length = KMALLOC_FENCE;
+	kmalloc_set_state(fence, KMALLOC_STATE_FENCE);
+
+	struct kmalloc_chunk *end = (struct kmalloc_chunk *) (base + size - KUNIT);
+	end->state = KMALLOC_STATE_FENCE;
+	end->length = KUNIT;
+
+	fence->prev = 0;
+	fence->next = arenas;
+	if(arenas)
+		arenas->prev = fence;
+	arenas = fence;
+
+	struct kmalloc_chunk *c = (struct kmalloc_chunk *) (base + KMALLOC_FENCE);
+	c->length = size - KMALLOC_FENCE - KUNIT;
+	kmalloc_set_state(c, KMALLOC_STATE_FREE);
+	kmalloc_list_insert(c);
+
+	return c;
+}
+
+static void kmalloc_shrink(struct kmalloc_chunk *fence)
+{
+	if(fence->prev) {
+		fence->prev->next = fence->next;
+	} else {
+		arenas = fence->next;
+	}
+	if(fence->next)
+		fence->next->prev = fence->prev;
+
+	vfree(fence);
 }
 
 /*
-Attempt to merge a chunk with its successor,
-if it exists and both are in the free state.
+Allocate a chunk of memory of the given length.
+To avoid fragmentation, round up the length to
+a multiple of the chunk size.  Then, take a chunk of
+the desired size from the free lists, and split it if necessary.
 */
 
-static void kmerge(struct kmalloc_chunk *c)
+void *kmalloc(int length)
 {
+	// add room for the header and footer, then round up to a multiple of KUNIT
+	length += KUNIT + KTAG;
+	int extra = length % KUNIT;
+	if(extra)
+		length += (KUNIT - extra);
+
+	struct kmalloc_chunk *c = kmalloc_find(length);
 	if(!c)
-		return;
+		c = kmalloc_grow(length);
+	if(!c) {
+		printf("kmalloc: out of memory!\n");
+		return 0;
+	}
 
-	if(c->state != KMALLOC_STATE_FREE)
-		return;
+	kmalloc_list_remove(c);
 
-	if(c->next && c->next->state == KMALLOC_STATE_FREE) {
-		c->length += c->next->length;
-		if(c->next->next) {
-			c->next->next->prev = c;
-		}
-		c->next = c->next->next;
+	// split the chunk if the remainder can hold another chunk
+	if((c->length - length) >= KMALLOC_MIN_CHUNK) {
+		ksplit(c, length);
 	}
 
+	kmalloc_set_state(c, KMALLOC_STATE_USED);
+
+#ifdef ALLOC_PROFILE
+	// the list links are unused while a chunk is allocated, so keep the call site there
+	c->next = __builtin_return_address(0);
+	allocprof_alloc(ALLOCPROF_KMALLOC, c->next, c->length);
+#endif
+
+	// return a pointer to the memory following the chunk header
+	return (c + 1);
 }
 
 /*
 Free memory by marking the chunk as de-allocated,
-then attempting to merge it with the predecessor and successor.
+then merging it with its predecessor and successor
+if they are free, and placing the result on a free list.
 */
 
 void kfree(void *ptr)
@@ -150,38 +323,81 @@ void kfree(void *ptr)
 	struct kmalloc_chunk *c = (struct kmalloc_chunk *) ptr;
 	c--;
 
-	if(c->state != KMALLOC_STATE_USED) {
+	if(c->state != KMALLOC_STATE_USED || kmalloc_footer(c)->state != KMALLOC_STATE_USED) {
 		printf("invalid kfree(%x)\n", ptr);
 		return;
 	}
 
-	c->state = KMALLOC_STATE_FREE;
+#ifdef ALLOC_PROFILE
+	allocprof_free(ALLOCPROF_KMALLOC, c->next, c->length);
+#endif
 
-	kmerge(c);
-	kmerge(c->prev);
-}
+	struct kmalloc_chunk *n = kmalloc_after(c);
+	if(n && n->state == KMALLOC_STATE_FREE) {
+		kmalloc_list_remove(n);
+		c->length += n->length;
+	}
 
-void kmalloc_debug()
-{
-	struct kmalloc_chunk *c;
+	struct kmalloc_chunk *p = kmalloc_before(c);
+	if(p && p->state == KMALLOC_STATE_FREE) {
+		kmalloc_list_remove(p);
+		p->length += c->length;
+		c = p;
+	}
 
-	printf("state ptr      prev     next     length\n");
+	// an arena with nothing left in it goes back to vmalloc
+	p = kmalloc_before(c);
+	n = kmalloc_after(c);
+	if(p && p->state == KMALLOC_STATE_FENCE && n && n->state == KMALLOC_STATE_FENCE) {
+		kmalloc_shrink(p);
+		return;
+	}
 
-	for(c = head; c; c = c->next) {
+	kmalloc_set_state(c, KMALLOC_STATE_FREE);
+	kmalloc_list_insert(c);
+}
+
+static int kmalloc_debug_chunks(struct kmalloc_chunk *c)
+{
+	for(; c && c->state != KMALLOC_STATE_FENCE; c = kmalloc_after(c)) {
 		if(c->state == KMALLOC_STATE_FREE) {
 			printf("F");
 		} else if(c->state == KMALLOC_STATE_USED) {
 			printf("U");
 		} else {
 			printf("kmalloc list corrupted at %x!\n", c);
-			return;
+			return 0;
+		}
+		if(kmalloc_footer(c)->state != c->state || kmalloc_footer(c)->length != c->length) {
+			printf("kmalloc boundary tag corrupted at %x!\n", c);
+			return 0;
 		}
 		printf("     %x %x %x %d\n", c, c->prev, c->next, c->length);
 	}
+	return 1;
+}
+
+void kmalloc_debug()
+{
+	struct kmalloc_chunk *a;
+
+	printf("state ptr      prev     next     length\n");
+
+	if(!kmalloc_debug_chunks(head))
+		return;
+
+	for(a = arenas; a; a = a->next) {
+		printf("arena %x\n", a);
+		if(!kmalloc_debug_chunks((struct kmalloc_chunk *) ((char *) a + KMALLOC_FENCE)))
+			return;
+	}
 }
 
 // Testing
 
+#define KMALLOC_TEST_OBJECTS 256
+#define KMALLOC_TEST_ROUNDS 64
+
 static void setup(void)
 {
 	kmalloc_init((char *) KMALLOC_START, KMALLOC_LENGTH);
@@ -191,15 +407,29 @@ static void tear_down(void)
 {
 }
 
+static int kmalloc_chunk_length(int length)
+{
+	length += KUNIT + KTAG;
+	if(length % KUNIT)
+		length += KUNIT - length % KUNIT;
+	return length;
+}
+
+// Returns true if the heap has returned to a single free chunk.
+static int kmalloc_heap_is_empty(void)
+{
+	return head->state == KMALLOC_STATE_FREE && head->length == KMALLOC_LENGTH && kmalloc_after(head) == 0;
+}
+
 static int kmalloc_test_single_alloc(void)
 {
 	char *ptr = kmalloc(128);
 	struct kmalloc_chunk *next = 0;
 	int res = (unsigned long) ptr == (unsigned long) head + sizeof(struct kmalloc_chunk);
 	res &= head->state == KMALLOC_STATE_USED;
-	res &= head->length == 128 + sizeof(struct kmalloc_chunk);
-	res &= (char *) head->next == (char *) KMALLOC_START + head->length;
-	next = head->next;
+	res &= head->length == kmalloc_chunk_length(128);
+	res &= (char *) kmalloc_after(head) == (char *) KMALLOC_START + head->length;
+	next = kmalloc_after(head);
 	res &= next->state == KMALLOC_STATE_FREE;
 	res &= next->length == KMALLOC_LENGTH - head->length;
 
@@ -212,16 +442,101 @@ static int kmalloc_test_single_alloc_and_free(void)
 	int res;
 	kfree(ptr);
 	res = head->state == KMALLOC_STATE_FREE;
-	res &= head->next == 0;
+	res &= kmalloc_after(head) == 0;
 	res &= head->length == KMALLOC_LENGTH;
 
 	return res;
 }
 
+static int kmalloc_test_merge_both_sides(void)
+{
+	char *a = kmalloc(64);
+	char *b = kmalloc(64);
+	char *c = kmalloc(64);
+	char *d = kmalloc(64);
+	int res;
+
+	kfree(a);
+	kfree(c);
+
+	// b must merge with a before it and c after it
+	kfree(b);
+	res = head->state == KMALLOC_STATE_FREE;
+	res &= head->length == 3 * kmalloc_chunk_length(64);
+	res &= kmalloc_after(head) == (struct kmalloc_chunk *) d - 1;
+
+	kfree(d);
+	res &= kmalloc_heap_is_empty();
+
+	return res;
+}
+
+static int kmalloc_test_fragmentation(void)
+{
+	char *ptrs[KMALLOC_TEST_OBJECTS];
+	int i, res = 1;
+
+	// interleave small and large objects, then free every other one
+	for(i = 0; i < KMALLOC_TEST_OBJECTS; i++) {
+		ptrs[i] = kmalloc((i % 2) ? 4000 : 24);
+		res &= ptrs[i] != 0;
+	}
+	for(i = 1; i < KMALLOC_TEST_OBJECTS; i += 2) {
+		kfree(ptrs[i]);
+	}
+
+	// small requests must reuse the holes rather than extend the heap
+	char *high = ptrs[KMALLOC_TEST_OBJECTS - 1];
+	for(i = 1; i < KMALLOC_TEST_OBJECTS; i += 2) {
+		ptrs[i] = kmalloc(24);
+		res &= ptrs[i] != 0 && ptrs[i] < high;
+	}
+
+	for(i = 0; i < KMALLOC_TEST_OBJECTS; i++) {
+		kfree(ptrs[i]);
+	}
+
+	// all of the holes must have merged back together
+	res &= kmalloc_heap_is_empty();
+
+	return res;
+}
+
+static int kmalloc_test_throughput(void)
+{
+	char *ptrs[KMALLOC_TEST_OBJECTS];
+	int i, j, res = 1;
+	clock_t start, elapsed;
+
+	start = clock_read();
+
+	for(j = 0; j < KMALLOC_TEST_ROUNDS; j++) {
+		for(i = 0; i < KMALLOC_TEST_OBJECTS; i++) {
+			ptrs[i] = kmalloc(16 + (i * 37 + j * 11) % 1024);
+			res &= ptrs[i] != 0;
+		}
+		// free in a different order than allocated
+		for(i = 0; i < KMALLOC_TEST_OBJECTS; i += 2) {
+			kfree(ptrs[i]);
+		}
+		for(i = KMALLOC_TEST_OBJECTS - 1; i > 0; i -= 2) {
+			kfree(ptrs[i]);
+		}
+	}
+
+	elapsed = clock_diff(start, clock_read());
+	printf("%d ops in %d.%d s...", 2 * KMALLOC_TEST_ROUNDS * KMALLOC_TEST_OBJECTS, elapsed.seconds, elapsed.millis);
+
+	res &= kmalloc_heap_is_empty();
+
+	return res;
+}
+
 int kmalloc_test(void)
 {
 	int (*tests[]) (void) = {
-	kmalloc_test_single_alloc, kmalloc_test_single_alloc_and_free,};
+	kmalloc_test_single_alloc, kmalloc_test_single_alloc_and_free,
+	kmalloc_test_merge_both_sides, kmalloc_test_fragmentation, kmalloc_test_throughput,};
 
 	int i = 0;
 	for(i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
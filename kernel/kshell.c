@@ -31,6 +31,10 @@ The current version is 1.2.9
 #include "printf.h"
 #include "graphics.h" // Include your graphics header
 #include "memorylayout.h"
+#include "allocprof.h"
+#include "swap.h"
+#include "kthread.h"
+#include "slab.h"
 
 // define the start screen for when the gui starts
 #define COLOR_BLUE  0x0000FF      // RGB hex for blue (blue channel max)
@@ -43,6 +47,7 @@ The current version is 1.2.9
 
 static char current_working_directory[1024] = "/";
 static int cursor_pid = 0;
+static struct process *cursor_thread = 0;
 extern int boot_screen_w;
 extern int boot_screen_h;
 void mouse_cursor_task(void);
@@ -479,9 +484,46 @@ static int kshell_execute(int argc, const char **argv)
         list_drives();
     } else if (!strcmp(cmd, "list-proc")) {
         process_list();
+    } else if (!strcmp(cmd, "slabs")) {
+        slab_debug();
+    } else if (!strcmp(cmd, "allocprof")) {
+        if (argc > 2 && !strcmp(argv[1], "serial")) {
+            int port;
+            str2int(argv[2], &port);
+            allocprof_export(port);
+        } else if (argc > 1 && !strcmp(argv[1], "reset")) {
+            allocprof_reset();
+        } else {
+            allocprof_print();
+        }
+    } else if (!strcmp(cmd, "timeslice")) {
+        int millis;
+        if (argc > 1 && str2int(argv[1], &millis) && millis > 0) {
+            clock_slice_set(millis);
+        }
+        printf("timeslice: %d ms\n", clock_slice_get());
+    } else if (!strcmp(cmd, "swapon")) {
+        int unit, first = 0, count = 0;
+        if (argc >= 3 && str2int(argv[2], &unit) && (argc < 4 || str2int(argv[3], &first)) && (argc < 5 || str2int(argv[4], &count))) {
+            struct device *dev = device_open(argv[1], unit);
+            if (dev) {
+                int nslots = swap_enable(dev, first, count);
+                if (nslots > 0) {
+                    printf("swapon: %d KB of swap on %s unit %d\n", nslots * (PAGE_SIZE / 1024), argv[1], unit);
+                } else {
+                    printf("swapon: couldn't enable swap on %s unit %d\n", argv[1], unit);
+                }
+                device_close(dev);
+            } else {
+                printf("swapon: couldn't open device %s unit %d\n", argv[1], unit);
+            }
+        } else {
+            printf("Usage: swapon <device> <unit> [first-block [nblocks]]\n");
+        }
     } else if (!strcmp(cmd, "cursor-init")) {
-        if (cursor_pid > 0) {
-            process_kill(cursor_pid);
+        if (cursor_thread) {
+            kthread_stop(cursor_thread);
+            cursor_thread = 0;
             mouse_hide();
         }
         create_cursor_task();
@@ -618,6 +660,10 @@ if (current->ktable[KNO_STDDIR]) {
         printf("contents <file>\n");
         printf("list-drives\n");
         printf("list-proc\n");
+        printf("slabs\n");
+        printf("allocprof [reset | serial <port>]\n");
+        printf("swapon <device> <unit> [first-block [nblocks]]\n");
+        printf("timeslice [ms]\n");
         printf("cursor-init\n");
         printf("cowsay\n\n");
         printf("cd <dir>\n");
@@ -1275,28 +1321,21 @@ void mouse_cursor_task(void) {
     cursor_pid = current->pid;
 }
 
-void mouse_cursor_thread() {
+void mouse_cursor_thread(void *arg) {
     mouse_cursor_task();
-    while(1) {
-        process_yield();
+    // The cursor is drawn from the interrupt handler, so the thread
+    // has nothing more to do.  It must park rather than yield,
+    // since at realtime priority a yield would never let anyone else run.
+    while (!kthread_should_stop()) {
+        kthread_park();
     }
 }
 
 void create_cursor_task() {
-    struct process *p = process_create();
-    if (!p) {
+    cursor_thread = kthread_create(mouse_cursor_thread, 0, "CURSOR", PROCESS_PRIORITY_REALTIME);
+    if (!cursor_thread) {
         printf("Failed to create cursor task\n");
-        return;
     }
-    struct x86_stack *s = (struct x86_stack *)p->kstack_ptr;
-    s->eip = (unsigned)mouse_cursor_thread;
-    s->cs = 0x08; // Kernel Code
-    s->ds = 0x10; // Kernel Data
-    s->es = 0x10;
-    
-    strcpy(p->name, "CURSOR");
-
-    process_launch(p);
 }
 
 extern int GUI();
@@ -0,0 +1,271 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "ksm.h"
+#include "process.h"
+#include "pagetable.h"
+#include "page.h"
+#include "slab.h"
+#include "string.h"
+#include "clock.h"
+#include "memorylayout.h"
+#include "kernel/types.h"
+
+/*
+A page is only considered once it has stayed clean for a whole
+pass of the scanner, since a page that is being written would be
+copied right back out again after merging.  Clean pages are hashed
+and recorded in the unstable table, by process and address, without
+changing their mappings.  When a second page with the same contents
+turns up, both are merged into a stable page: it is write protected
+in every mapping, and the scanner keeps a reference of its own, so
+that a later write always copies instead of changing it in place.
+Further pages with the same contents are merged straight into it.
+
+The unstable table is emptied at the start of each pass, since the
+pages it names may have changed since.  Stable pages left with no
+mapping but the scanner's own are released at the same time.
+*/
+
+#define KSM_BUCKETS 256
+#define KSM_UNSTABLE_MAX 4096
+#define KSM_PAGES_PER_CALL 8
+#define KSM_SCAN_INTERVAL 1000
+
+#define KSM_SCAN_START PROCESS_ENTRY_POINT
+#define KSM_SCAN_END (PROCESS_STACK_INIT & PAGE_MASK)
+
+struct ksm_stable {
+	struct ksm_stable *next;
+	uint32_t hash;
+	void *page;
+};
+
+struct ksm_unstable {
+	struct ksm_unstable *next;
+	uint32_t hash;
+	int pid;
+	unsigned vaddr;
+};
+
+static struct slab_cache ksm_stable_cache = SLAB_CACHE_INIT("ksm_stable", sizeof(struct ksm_stable), 0);
+static struct slab_cache ksm_unstable_cache = SLAB_CACHE_INIT("ksm_unstable", sizeof(struct ksm_unstable), 0);
+
+static struct ksm_stable *stable_table[KSM_BUCKETS];
+static struct ksm_unstable *unstable_table[KSM_BUCKETS];
+static unsigned unstable_count = 0;
+
+static int scan_pid = 0;
+static unsigned scan_vaddr = KSM_SCAN_START;
+static clock_t scan_finished = { 0, 0 };
+
+static uint32_t ksm_hash(const void *page)
+{
+	const uint32_t *w = page;
+	uint32_t h = 2166136261u;
+	unsigned i;
+
+	for(i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		h = (h ^ w[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+static void ksm_pass_start()
+{
+	unsigned i;
+
+	for(i = 0; i < KSM_BUCKETS; i++) {
+		while(unstable_table[i]) {
+			struct ksm_unstable *u = unstable_table[i];
+			unstable_table[i] = u->next;
+			slab_free(&ksm_unstable_cache, u);
+		}
+
+		struct ksm_stable **sp = &stable_table[i];
+		while(*sp) {
+			struct ksm_stable *s = *sp;
+			if(page_refcount(s->page) <= 1) {
+				*sp = s->next;
+				page_free(s->page);
+				slab_free(&ksm_stable_cache, s);
+			} else {
+				sp = &s->next;
+			}
+		}
+	}
+
+	unstable_count = 0;
+}
+
+static struct ksm_stable *ksm_stable_lookup(uint32_t hash, void *page)
+{
+	struct ksm_stable *s;
+
+	for(s = stable_table[hash % KSM_BUCKETS]; s; s = s->next) {
+		if(s->hash == hash && !memcmp(s->page, page, PAGE_SIZE))
+			return s;
+	}
+
+	return 0;
+}
+
+/*
+Find a page in the unstable table that still has the same contents,
+and is still private to the process that was seen mapping it.
+Entries that no longer match are dropped along the way.
+*/
+
+static int ksm_unstable_lookup(uint32_t hash, void *page, struct process **owner, unsigned *vaddr, unsigned *paddr)
+{
+	struct ksm_unstable **up = &unstable_table[hash % KSM_BUCKETS];
+
+	while(*up) {
+		struct ksm_unstable *u = *up;
+		if(u->hash != hash) {
+			up = &u->next;
+			continue;
+		}
+
+		*up = u->next;
+
+		struct process *p = process_table[u->pid];
+		unsigned v = u->vaddr;
+		int found = p && p->state != PROCESS_STATE_GRAVE && !process_running_elsewhere(p) && pagetable_next_private(p->pagetable, &v, u->vaddr + PAGE_SIZE, paddr) && !memcmp((void *) *paddr, page, PAGE_SIZE);
+
+		slab_free(&ksm_unstable_cache, u);
+		unstable_count--;
+
+		if(found) {
+			*owner = p;
+			*vaddr = v;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void ksm_unstable_insert(uint32_t hash, int pid, unsigned vaddr)
+{
+	if(unstable_count >= KSM_UNSTABLE_MAX)
+		return;
+
+	struct ksm_unstable *u = slab_alloc(&ksm_unstable_cache);
+	if(!u)
+		return;
+
+	u->hash = hash;
+	u->pid = pid;
+	u->vaddr = vaddr;
+	u->next = unstable_table[hash % KSM_BUCKETS];
+	unstable_table[hash % KSM_BUCKETS] = u;
+	unstable_count++;
+}
+
+static void ksm_scan_page(struct process *p, unsigned vaddr, unsigned paddr)
+{
+	if(pagetable_clear_dirty(p->pagetable, vaddr))
+		return;
+
+	uint32_t hash = ksm_hash((void *) paddr);
+
+	struct ksm_stable *s = ksm_stable_lookup(hash, (void *) paddr);
+	if(s) {
+		pagetable_share(p->pagetable, vaddr, (unsigned) s->page);
+		return;
+	}
+
+	struct process *q;
+	unsigned qvaddr, qpaddr;
+
+	if(!ksm_unstable_lookup(hash, (void *) paddr, &q, &qvaddr, &qpaddr)) {
+		ksm_unstable_insert(hash, p->pid, vaddr);
+		return;
+	}
+
+	s = slab_alloc(&ksm_stable_cache);
+	if(!s)
+		return;
+
+	page_addref((void *) qpaddr);
+	s->hash = hash;
+	s->page = (void *) qpaddr;
+	s->next = stable_table[hash % KSM_BUCKETS];
+	stable_table[hash % KSM_BUCKETS] = s;
+
+	pagetable_share(q->pagetable, qvaddr, qpaddr);
+	pagetable_share(p->pagetable, vaddr, qpaddr);
+}
+
+/*
+Scan a few pages for merging, continuing from where the last call
+left off.  Once every process has been scanned, wait a while before
+starting over, so that an idle machine is not kept busy hashing.
+Called from the idle loop with interrupts blocked, and returns 1
+if it did some work, so that the idle loop can check for a runnable
+process between calls instead of scanning everything at once.
+*/
+
+int ksm_idle()
+{
+	int n = 0;
+
+	if(scan_pid == 0) {
+		clock_t elapsed = clock_diff(scan_finished, clock_read());
+		if(elapsed.seconds * 1000 + elapsed.millis < KSM_SCAN_INTERVAL)
+			return 0;
+		ksm_pass_start();
+		scan_pid = 1;
+		scan_vaddr = KSM_SCAN_START;
+	}
+
+	while(n < KSM_PAGES_PER_CALL && scan_pid < PROCESS_MAX_PID) {
+		struct process *p = process_table[scan_pid];
+		unsigned paddr;
+
+		if(p && p->state != PROCESS_STATE_GRAVE && !process_running_elsewhere(p) && pagetable_next_private(p->pagetable, &scan_vaddr, KSM_SCAN_END, &paddr)) {
+			ksm_scan_page(p, scan_vaddr, paddr);
+			scan_vaddr += PAGE_SIZE;
+			n++;
+		} else {
+			scan_pid++;
+			scan_vaddr = KSM_SCAN_START;
+		}
+	}
+
+	if(scan_pid >= PROCESS_MAX_PID) {
+		scan_pid = 0;
+		scan_finished = clock_read();
+	}
+
+	return 1;
+}
+
+/*
+Count the stable pages, and the pages saved by sharing them:
+each stable page holds the scanner's reference plus one per mapping,
+and every mapping after the first would otherwise need its own page.
+*/
+
+void ksm_stats(unsigned *pages_shared, unsigned *pages_saved)
+{
+	unsigned i;
+	struct ksm_stable *s;
+
+	*pages_shared = 0;
+	*pages_saved = 0;
+
+	for(i = 0; i < KSM_BUCKETS; i++) {
+		for(s = stable_table[i]; s; s = s->next) {
+			int refs = page_refcount(s->page);
+			(*pages_shared)++;
+			if(refs > 2)
+				*pages_saved += refs - 2;
+		}
+	}
+}
@@ -0,0 +1,21 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef KSM_H
+#define KSM_H
+
+/*
+Same page merging looks for user pages with identical contents,
+in the same or different processes, and maps them all to a single
+read-only copy-on-write page, returning the duplicates to the
+page allocator.  The scan is done a few pages at a time from the
+idle loop, so it only uses time that would otherwise be wasted.
+*/
+
+int  ksm_idle();
+void ksm_stats(unsigned *pages_shared, unsigned *pages_saved);
+
+#endif
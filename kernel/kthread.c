@@ -0,0 +1,137 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "kthread.h"
+#include "process.h"
+#include "interrupt.h"
+#include "string.h"
+#include "x86.h"
+#include "cpu.h"
+#include "console.h"
+
+/*
+A new thread starts, like any new process, by returning through
+intr_return, but with kernel segments in its frame, so the iret
+stays in the kernel and lands in kthread_entry on the thread's own
+kernel stack.  Since it never goes back to user mode, it keeps the
+kernel lock taken on its behalf, hence the extra level of depth.
+*/
+
+static struct list park_list = LIST_INIT;
+
+static void kthread_entry()
+{
+	current->kthread_func(current->kthread_arg);
+	kthread_exit(0);
+}
+
+struct process *kthread_create(kthread_func_t func, void *arg, const char *name, int priority)
+{
+	struct process *p = process_create();
+	if(!p) {
+		printf("kthread: couldn't create %s\n", name);
+		return 0;
+	}
+
+	struct x86_stack *s = (struct x86_stack *) p->kstack_ptr;
+	s->eip = (unsigned) kthread_entry;
+	s->cs = X86_SEGMENT_KERNEL_CODE;
+	s->ds = X86_SEGMENT_KERNEL_DATA;
+	s->es = X86_SEGMENT_KERNEL_DATA;
+	s->fs = X86_SEGMENT_CPU;
+	s->eflags.iopl = 0;
+
+	p->lock_depth = 2;
+	p->kthread_func = func;
+	p->kthread_arg = arg;
+	p->kthread_flags = 0;
+	process_set_parent(p, current);
+	strncpy(p->name, name, sizeof(p->name) - 1);
+
+	process_set_priority(p, priority);
+	process_launch(p);
+
+	return p;
+}
+
+void kthread_exit(int code)
+{
+	process_exit(code);
+}
+
+/*
+Wait for the thread to exit, and release it.
+The caller becomes the thread's parent, so that the exit wakes it.
+*/
+
+int kthread_join(struct process *t)
+{
+	struct process_info info;
+	uint32_t pid = t->pid;
+
+	process_set_parent(t, current);
+	if(process_wait_child(pid, &info, -1) != pid)
+		return -1;
+
+	// process_reap refuses kernel threads, so release it here
+	list_remove(&t->node);
+	process_delete(t);
+	return info.exitcode;
+}
+
+/*
+Ask the thread to stop, wake it if it is parked, and wait for it.
+The thread must check kthread_should_stop whenever it wakes.
+*/
+
+int kthread_stop(struct process *t)
+{
+	t->kthread_flags |= KTHREAD_FLAG_STOP;
+	kthread_unpark(t);
+	return kthread_join(t);
+}
+
+int kthread_should_stop()
+{
+	return (current->kthread_flags & KTHREAD_FLAG_STOP) != 0;
+}
+
+/*
+Block the current thread until kthread_unpark is called for it.
+An unpark that arrives while the thread is still running is not
+lost: the next park returns at once instead.
+*/
+
+void kthread_park()
+{
+	interrupt_block();
+	if(!(current->kthread_flags & (KTHREAD_FLAG_UNPARK | KTHREAD_FLAG_STOP))) {
+		process_wait(&park_list);
+		interrupt_block();
+	}
+	current->kthread_flags &= ~KTHREAD_FLAG_UNPARK;
+	interrupt_unblock();
+}
+
+int kthread_parked(struct process *t)
+{
+	return t->state == PROCESS_STATE_BLOCKED && t->node.list == &park_list;
+}
+
+/*
+Wake a parked thread, returning 1 if it was parked.  May be called
+from an interrupt handler.
+*/
+
+int kthread_unpark(struct process *t)
+{
+	if(kthread_parked(t)) {
+		process_wakeup_one(t);
+		return 1;
+	}
+	t->kthread_flags |= KTHREAD_FLAG_UNPARK;
+	return 0;
+}
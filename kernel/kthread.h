@@ -0,0 +1,36 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef KTHREAD_H
+#define KTHREAD_H
+
+#include "process.h"
+
+/*
+A kernel thread is a process that never leaves the kernel: it runs
+func(arg) on its own kernel stack, holding the kernel lock like any
+other kernel code, and exits when func returns.  Kernel threads are
+never preempted, so one that runs for long should call process_yield
+now and then.  A thread with nothing to do parks itself until another
+thread or an interrupt handler unparks it.
+*/
+
+typedef void (*kthread_func_t) (void *arg);
+
+#define KTHREAD_FLAG_UNPARK 1
+#define KTHREAD_FLAG_STOP   2
+
+struct process *kthread_create(kthread_func_t func, void *arg, const char *name, int priority);
+int  kthread_join(struct process *t);
+int  kthread_stop(struct process *t);
+void kthread_exit(int code);
+
+void kthread_park();
+int  kthread_unpark(struct process *t);
+int  kthread_parked(struct process *t);
+int  kthread_should_stop();
+
+#endif
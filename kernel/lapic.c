@@ -0,0 +1,142 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "lapic.h"
+#include "interrupt.h"
+
+#define CPUID_FEATURE_APIC (1<<9)
+
+#define MSR_APIC_BASE        0x1b
+#define MSR_APIC_BASE_ENABLE (1<<11)
+#define MSR_APIC_BASE_MASK   0xfffff000
+
+#define LAPIC_ID            0x020
+#define LAPIC_EOI           0x0b0
+#define LAPIC_SPURIOUS      0x0f0
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3e0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+
+#define LAPIC_SPURIOUS_ENABLE (1<<8)
+#define LAPIC_LVT_MASKED      (1<<16)
+#define LAPIC_DIVIDE_BY_16    0x3
+
+#define LAPIC_ICR_FIXED       0x000
+#define LAPIC_ICR_INIT        0x500
+#define LAPIC_ICR_STARTUP     0x600
+#define LAPIC_ICR_ASSERT      (1<<14)
+#define LAPIC_ICR_PENDING     (1<<12)
+
+static volatile uint32_t *lapic = 0;
+
+static uint32_t lapic_read(int reg)
+{
+	return lapic[reg / 4];
+}
+
+static void lapic_write(int reg, uint32_t value)
+{
+	lapic[reg / 4] = value;
+}
+
+/*
+Enable the local APIC, if the processor has one, leaving the
+timer stopped.  The legacy PIC continues to deliver the other
+interrupts through the local APIC as before.
+*/
+
+int lapic_init()
+{
+	uint32_t eax, ebx, ecx, edx;
+	asm("cpuid":"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx):"a"(1));
+	if(!(edx & CPUID_FEATURE_APIC))
+		return 0;
+
+	uint32_t lo, hi;
+	asm volatile("rdmsr":"=a"(lo), "=d"(hi):"c"(MSR_APIC_BASE));
+	lo |= MSR_APIC_BASE_ENABLE;
+	asm volatile("wrmsr"::"a"(lo), "d"(hi), "c"(MSR_APIC_BASE));
+
+	lapic = (volatile uint32_t *) (lo & MSR_APIC_BASE_MASK);
+
+	lapic_write(LAPIC_SPURIOUS, LAPIC_SPURIOUS_ENABLE | INTERRUPT_LAPIC_SPURIOUS);
+	lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_BY_16);
+	lapic_timer_set(0, 0);
+
+	return 1;
+}
+
+uint32_t lapic_address()
+{
+	return (uint32_t) lapic;
+}
+
+void lapic_eoi()
+{
+	if(lapic)
+		lapic_write(LAPIC_EOI, 0);
+}
+
+/*
+Start the timer counting down from count, in one-shot mode.
+If interrupt is set, INTERRUPT_LAPIC_TIMER is raised when it reaches
+zero, otherwise it counts silently.  A count of zero stops the timer.
+*/
+
+void lapic_timer_set(uint32_t count, int interrupt)
+{
+	lapic_write(LAPIC_LVT_TIMER, INTERRUPT_LAPIC_TIMER | (interrupt ? 0 : LAPIC_LVT_MASKED));
+	lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+uint32_t lapic_timer_remaining()
+{
+	return lapic_read(LAPIC_TIMER_CURRENT);
+}
+
+uint32_t lapic_id()
+{
+	return lapic ? lapic_read(LAPIC_ID) >> 24 : 0;
+}
+
+/*
+Send an interprocessor interrupt to the processor with the given
+APIC id, and wait until the local APIC has accepted it for delivery.
+*/
+
+static void lapic_ipi(uint32_t apic_id, uint32_t command)
+{
+	lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+	lapic_write(LAPIC_ICR_LOW, command);
+
+	while(lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+		asm volatile("pause");
+	}
+}
+
+void lapic_send_ipi(uint32_t apic_id, int interrupt)
+{
+	if(lapic)
+		lapic_ipi(apic_id, LAPIC_ICR_FIXED | LAPIC_ICR_ASSERT | interrupt);
+}
+
+/*
+INIT resets the target processor into a wait for a startup IPI,
+which then starts it in real mode at address page << 12.
+*/
+
+void lapic_send_init(uint32_t apic_id)
+{
+	lapic_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+}
+
+void lapic_send_startup(uint32_t apic_id, uint32_t page)
+{
+	lapic_ipi(apic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | (page & 0xff));
+}
@@ -0,0 +1,33 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include "kernel/types.h"
+
+/*
+The local APIC of each processor has a timer that can raise a single
+interrupt after a given number of bus clocks, which is all the
+kernel needs to sleep until exactly the next event.  lapic_init
+must be called before paging is enabled, so that the registers
+are mapped along with the rest of the kernel.  Each processor
+calls lapic_init for its own local APIC, which is found at the
+same address on all of them.  The same registers send
+interrupts to other processors.
+*/
+
+int      lapic_init();
+uint32_t lapic_address();
+void     lapic_eoi();
+void     lapic_timer_set(uint32_t count, int interrupt);
+uint32_t lapic_timer_remaining();
+uint32_t lapic_id();
+void     lapic_send_ipi(uint32_t apic_id, int interrupt);
+void     lapic_send_init(uint32_t apic_id);
+void     lapic_send_startup(uint32_t apic_id, uint32_t page);
+
+#endif
@@ -34,6 +34,29 @@ void list_push_tail(struct list *list, struct list_node *node)
 	list->size++;
 }
 
+/*
+Insert node just before n, or at the tail if n is null.
+*/
+
+void list_insert_before(struct list *list, struct list_node *n, struct list_node *node)
+{
+	if(!n) {
+		list_push_tail(list, node);
+		return;
+	}
+	node->next = n;
+	node->prev = n->prev;
+	node->priority = 0;
+	if(n->prev) {
+		n->prev->next = node;
+	} else {
+		list->head = node;
+	}
+	n->prev = node;
+	node->list = list;
+	list->size++;
+}
+
 void list_push_priority(struct list *list, struct list_node *node, int pri)
 {
 	struct list_node *n;
@@ -109,8 +132,8 @@ void list_remove(struct list_node *node)
 	node->next->prev = node->prev;
 	node->prev->next = node->next;
 	node->next = node->prev = 0;
-	node->list = 0;
 	node->list->size--;
+	node->list = 0;
 }
 
 int list_size( struct list *list )
@@ -24,7 +24,13 @@ See the file LICENSE for details.
 #include "memorylayout.h"
 #include "kshell.h"
 #include "diskfs.h"
+#include "bcache.h"
 #include "serial.h"
+#include "zram.h"
+#include "cpu.h"
+#include "workqueue.h"
+#include "fpu.h"
+#include "timepage.h"
 #include <stddef.h>
 
 /* Simple LCG for kernel-level randomness */
@@ -93,7 +99,7 @@ void detect_memory() {
     uint32_t mem;
     uint32_t step = 1024 * 1024;
     printf("Detecting memory...\n");
-    for(mem = MAIN_MEMORY_START; mem < 0xFFF00000; mem += step) {
+    for(mem = MAIN_MEMORY_START; mem < KERNEL_VMALLOC_START; mem += step) {
         volatile uint32_t *p = (uint32_t*)mem;
         uint32_t old = *p;
         *p = 0x55AA55AA;
@@ -108,6 +114,8 @@ void detect_memory() {
 
 int kernel_main()
 {
+    cpu_init();
+
     struct console *console = console_create_root();
     console_addref(console);
 
@@ -150,6 +158,8 @@ int kernel_main()
     kmalloc_init((char *) KMALLOC_START, KMALLOC_LENGTH);
 
     interrupt_init();
+    fpu_init();
+    timepage_init();
     rtc_init();
     seed_boot_rand(); // Now using inline cmos_read to avoid linker error
 
@@ -157,6 +167,10 @@ int kernel_main()
     keyboard_init();
     clock_init();
     process_init();
+    cpu_start();
+    workqueue_init();
+    bcache_init();
+    zram_init();
     ata_init();
     cdrom_init();
     diskfs_init();
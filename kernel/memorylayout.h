@@ -35,6 +35,14 @@ and by the kernel when no process is active.
 #define INTERRUPT_STACK_SEGMENT 0x0000
 #define INTERRUPT_STACK_OFFSET  0xfff0
 
+/*
+Other processors start up in real mode, at a page aligned address
+below 1MB and clear of the initial stack, where the startup code
+is copied before each is woken.
+*/
+
+#define CPU_TRAMPOLINE_START 0x7000
+
 /*
 We choose the kernel code to start at 0x10000 (64KB).
 Code is loaded into this location by the bootblock.
@@ -61,6 +69,16 @@ memory allocations for internal kernel purposes.
 #define KMALLOC_START  0x100000
 #define KMALLOC_LENGTH 0x2000000
 
+/*
+Memory beyond the kmalloc area is mapped on demand by vmalloc()
+into this range of kernel virtual addresses.  Physical memory is
+identity mapped below it, so detect_memory() does not use RAM
+above the start of the range.
+*/
+
+#define KERNEL_VMALLOC_START 0x70000000
+#define KERNEL_VMALLOC_END   0x80000000
+
 /*
 Main memory starts at the 2MB boundary following the kmalloc area.
 This area is tracked by memory.c and used for allocatable pages, which can
@@ -79,6 +97,14 @@ grow down.  Addresses below 0x80000000 are all supervisor mode.
 #define PROCESS_ENTRY_POINT 0x80000000
 #define PROCESS_STACK_INIT  0xfffffff0
 
+/*
+Files mapped into a process are placed between these addresses,
+above any reasonable heap and below any reasonable stack.
+*/
+
+#define PROCESS_MAP_START   0xc0000000
+#define PROCESS_MAP_END     0xf0000000
+
 /*
 The bootloader passes information to the kernel in a structure
 located at this fixed address.
@@ -7,26 +7,213 @@ See the file LICENSE for details.
 #include "console.h"
 #include "kernel/types.h"
 #include "page.h"
+#include "list.h"
 #include "string.h"
 #include "memorylayout.h"
 #include "kernelcore.h"
+#include "allocprof.h"
+#include "workqueue.h"
+#include "spinlock.h"
+
+/*
+Physical pages are managed by a binary buddy allocator.
+A free block of order k consists of 2^k contiguous pages,
+aligned on a 2^k page boundary in physical memory.  Each
+order has its own free list, and the list node is stored
+in the first page of the free block itself.  A small array
+of page frames, placed at the start of main memory, records
+the order and state of the first page of each block, so that
+page_free() can find the size of a block and whether its
+buddy is available for merging.  The frame also holds a reference
+count, so that a page shared between address spaces is only
+returned to the free lists when its last user calls page_free().
+A count that reaches PAGE_REFCOUNT_MAX sticks there, and the page
+is never freed, rather than wrapping around and being freed while
+still in use.
+
+The allocator is the first structure with a lock of its own.
+page_lock covers the free lists, the frames, the free count, the
+zero pool and the shrinker flags, and is taken with interrupts
+blocked.  It is never held while calling out of the allocator, to
+a shrinker or a work queue, or while clearing a page.  Callers must
+still hold the kernel lock, since the work queues and the shrinkers'
+own lists rely on it alone.
+*/
+
+#define PAGE_FRAME_FREE  1	// first page of a free block
+#define PAGE_FRAME_ALLOC 2	// first page of an allocated block
+
+#define PAGE_REFCOUNT_MAX 0xffff
+
+struct page_frame {
+	uint8_t order;
+	uint8_t flags;
+	uint16_t refcount;
+#ifdef ALLOC_PROFILE
+	void *site;
+#endif
+};
 
 static uint32_t pages_free = 0;
 static uint32_t pages_total = 0;
 
-static uint32_t *freemap = 0;
-static uint32_t freemap_bits = 0;
-static uint32_t freemap_bytes = 0;
-static uint32_t freemap_cells = 0;
-static uint32_t freemap_pages = 0;
+static struct page_frame *frames = 0;
+static uint32_t frames_pages = 0;
+
+static uint32_t first_pfn = 0;
+static uint32_t last_pfn = 0;
+
+static struct list free_area[PAGE_ORDER_MAX + 1];
+
+static struct spinlock page_lock = SPINLOCK_INIT;
 
 static void *main_memory_start = (void *) MAIN_MEMORY_START;
 
-#define CELL_BITS (8*sizeof(*freemap))
+/*
+A small pool of pages that have already been cleared, so that
+page_alloc(1) does not have to clear a page on the spot.
+The pool is refilled by a work item on the background work queue,
+which clears PAGE_ZERO_BATCH pages at a time and then queues itself
+again, so that it only uses time that nothing else wants.  Refilling
+starts once the pool drops below the low watermark, and continues
+until it reaches the high watermark.
+The pages are kept in an array rather than a list, since a list
+node stored in the page itself would spoil its contents.
+*/
+
+#define PAGE_ZERO_POOL_LOW  16
+#define PAGE_ZERO_POOL_HIGH 64
+#define PAGE_ZERO_BATCH     8
+
+static void *zero_pool[PAGE_ZERO_POOL_HIGH];
+static unsigned zero_pool_count = 0;
+static int zero_pool_refilling = 1;
+
+static void page_zero_refill(struct work *w);
+static struct work zero_work = WORK_INIT(page_zero_refill, 0);
+
+#define PFN_TO_ADDR(pfn) ((void *)((pfn) << PAGE_BITS))
+#define ADDR_TO_PFN(addr) (((uint32_t)(addr)) >> PAGE_BITS)
+#define PFN_TO_FRAME(pfn) (&frames[(pfn) - first_pfn])
+
+/*
+The first pages of main memory are never handed out.
+This used to be a side effect of clearing freemap[0]:
+vmware doesn't like the use of a particular page
+close to 1MB, but what it is used for I don't know.
+*/
+
+#define PAGE_RESERVED_LOW 32
+
+static void page_block_insert(uint32_t pfn, unsigned order)
+{
+	struct page_frame *f = PFN_TO_FRAME(pfn);
+	f->order = order;
+	f->flags = PAGE_FRAME_FREE;
+	list_push_head(&free_area[order], (struct list_node *) PFN_TO_ADDR(pfn));
+}
+
+static void page_block_remove(uint32_t pfn)
+{
+	struct page_frame *f = PFN_TO_FRAME(pfn);
+	f->flags = 0;
+	list_remove((struct list_node *) PFN_TO_ADDR(pfn));
+}
+
+/*
+Release a block into the free lists, merging it with its
+buddy for as long as the buddy is also free and of the same order.
+*/
+
+static void page_block_release(uint32_t pfn, unsigned order)
+{
+	while(order < PAGE_ORDER_MAX) {
+		uint32_t buddy = pfn ^ (1 << order);
+		if(buddy < first_pfn || buddy + (1 << order) > last_pfn)
+			break;
+		struct page_frame *b = PFN_TO_FRAME(buddy);
+		if(b->flags != PAGE_FRAME_FREE || b->order != order)
+			break;
+		page_block_remove(buddy);
+		pfn &= ~(1 << order);
+		order++;
+	}
+	page_block_insert(pfn, order);
+}
+
+/*
+Caches are allowed to use any memory that is otherwise idle,
+but the allocator tries to keep PAGE_RESERVE pages free, so that
+a burst of allocations (a fork, say) can proceed without waiting
+on a cache to write back its dirty data.  When the free count drops
+below the reserve, reclaim_work is queued on the background work
+queue, where the shrinkers may block to release memory until the
+reserve is restored.  Only a request that cannot be satisfied at
+all reclaims directly, from the zero pool first and then from the
+shrinkers, which must not block when called that way.
+*/
+
+#define PAGE_RESERVE 256
+
+static struct page_shrinker *shrinker_list = 0;
+
+static void page_reclaim_work(struct work *w);
+static struct work reclaim_work = WORK_INIT(page_reclaim_work, 0);
+
+void page_shrinker_register(struct page_shrinker *s)
+{
+	struct page_shrinker **sp = &shrinker_list;
+	while(*sp)
+		sp = &(*sp)->next;
+	s->next = 0;
+	*sp = s;
+}
+
+/*
+A shrinker already at work, perhaps blocked in the background or
+allocating while it releases, is passed over rather than entered again.
+*/
+
+static unsigned page_reclaim(unsigned npages, int can_block)
+{
+	struct page_shrinker *s;
+	unsigned count = 0;
+
+	for(s = shrinker_list; s && count < npages; s = s->next) {
+		uint32_t flags = spinlock_acquire_block(&page_lock);
+		int active = s->active;
+		s->active = 1;
+		spinlock_release_restore(&page_lock, flags);
+		if(active)
+			continue;
+		count += s->shrink(npages - count, can_block);
+		flags = spinlock_acquire_block(&page_lock);
+		s->active = 0;
+		spinlock_release_restore(&page_lock, flags);
+	}
+
+	return count;
+}
+
+/*
+Restore the reserve a round at a time, queueing the work again
+after each round that made progress, so that the worker gives up
+the processor in between.
+*/
+
+static void page_reclaim_work(struct work *w)
+{
+	if(pages_free >= PAGE_RESERVE)
+		return;
+
+	if(page_reclaim(PAGE_RESERVE - pages_free, 1) > 0 && pages_free < PAGE_RESERVE)
+		work_queue(&workqueue_background, w);
+}
 
 void page_init()
 {
 	int i;
+	uint32_t pfn;
 
 	uint64_t mem_bytes = (uint64_t)total_memory * 1024 * 1024;
 	if (mem_bytes > MAIN_MEMORY_START) {
@@ -34,78 +221,331 @@ void page_init()
 	} else {
 		pages_total = 0;
 	}
-	pages_free = pages_total;
-	printf("memory: %d MB (%d KB) total\n", (pages_free * PAGE_SIZE) / MEGA, (pages_free * PAGE_SIZE) / KILO);
+	printf("memory: %d MB (%d KB) total\n", (pages_total * PAGE_SIZE) / MEGA, (pages_total * PAGE_SIZE) / KILO);
 
-	freemap = main_memory_start;
-	freemap_bits = pages_total;
-	freemap_bytes = 1 + freemap_bits / 8;
-	freemap_cells = 1 + freemap_bits / CELL_BITS;
-	freemap_pages = 1 + freemap_bytes / PAGE_SIZE;
+	first_pfn = ADDR_TO_PFN(main_memory_start);
+	last_pfn = first_pfn + pages_total;
 
-	printf("memory: %d bits %d bytes %d cells %d pages\n", freemap_bits, freemap_bytes, freemap_cells, freemap_pages);
+	frames = main_memory_start;
+	frames_pages = 1 + (pages_total * sizeof(struct page_frame)) / PAGE_SIZE;
 
-	memset(freemap, 0xff, freemap_bytes);
-	for(i = 0; i < freemap_pages; i++)
-		page_alloc(0);
+	printf("memory: %d frames %d bytes %d pages\n", pages_total, pages_total * sizeof(struct page_frame), frames_pages);
+
+	memset(frames, 0, pages_total * sizeof(struct page_frame));
+	for(i = 0; i <= PAGE_ORDER_MAX; i++) {
+		free_area[i].head = free_area[i].tail = 0;
+		free_area[i].size = 0;
+	}
 
-	// This is ahack that I don't understand yet.
-	// vmware doesn't like the use of a particular page
-	// close to 1MB, but what it is used for I don't know.
+	/*
+	Carve the usable range into the largest naturally
+	aligned blocks that fit, and put each on its free list.
+	*/
 
-	freemap[0] = 0x0;
+	pfn = first_pfn + MAX(frames_pages, PAGE_RESERVED_LOW);
+	while(pfn < last_pfn) {
+		unsigned order = PAGE_ORDER_MAX;
+		while(order > 0 && ((pfn & ((1 << order) - 1)) || pfn + (1 << order) > last_pfn))
+			order--;
+		page_block_insert(pfn, order);
+		pages_free += (1 << order);
+		pfn += (1 << order);
+	}
 
 	printf("memory: %d MB (%d KB) available\n", (pages_free * PAGE_SIZE) / MEGA, (pages_free * PAGE_SIZE) / KILO);
+
+	// fill the zero pool once the workers start
+	work_queue(&workqueue_background, &zero_work);
 }
 
-void page_stats( uint32_t *nfree, uint32_t *ntotal )
+void page_stats( uint32_t *nfree, uint32_t *ntotal, uint32_t *nblocks )
 {
-	*nfree = pages_free;
+	int i;
+	uint32_t flags = spinlock_acquire_block(&page_lock);
+
+	*nfree = pages_free + zero_pool_count;
 	*ntotal = pages_total;
+
+	if(nblocks) {
+		for(i = 0; i <= PAGE_ORDER_MAX; i++) {
+			nblocks[i] = list_size(&free_area[i]);
+		}
+	}
+
+	spinlock_release_restore(&page_lock, flags);
 }
 
-void *page_alloc(bool zeroit)
+static unsigned page_find_block(unsigned order)
+{
+	unsigned k;
+	for(k = order; k <= PAGE_ORDER_MAX; k++) {
+		if(free_area[k].head)
+			break;
+	}
+	return k;
+}
+
+/*
+Give the whole zero pool back to the free lists, where its pages
+may come together with their buddies into a larger block.
+*/
+
+static void page_zero_drain()
+{
+	while(zero_pool_count > 0) {
+		uint32_t pfn = ADDR_TO_PFN(zero_pool[--zero_pool_count]);
+		struct page_frame *f = PFN_TO_FRAME(pfn);
+		f->refcount = 0;
+		f->flags = 0;
+		pages_free++;
+		page_block_release(pfn, 0);
+	}
+}
+
+static void *page_alloc_block(unsigned order, bool zeroit)
 {
-	uint32_t i, j;
-	uint32_t cellmask;
-	uint32_t pagenumber;
+	unsigned k;
+	uint32_t pfn;
+	uint32_t flags;
 	void *pageaddr;
+	int low;
 
-	if(!freemap) {
+	if(!frames) {
 		printf("memory: not initialized yet!\n");
 		return 0;
 	}
 
-	for(i = 0; i < freemap_cells; i++) {
-		if(freemap[i] != 0) {
-			for(j = 0; j < CELL_BITS; j++) {
-				cellmask = (1 << j);
-				if(freemap[i] & cellmask) {
-					freemap[i] &= ~cellmask;
-					pagenumber = i * CELL_BITS + j;
-					pageaddr = (pagenumber << PAGE_BITS) + main_memory_start;
-					if(zeroit)
-						memset(pageaddr, 0, PAGE_SIZE);
-					pages_free--;
-					//printf("page: alloc %d\n",pages_free);
-					return pageaddr;
-				}
-			}
+	if(order > PAGE_ORDER_MAX) {
+		printf("memory: invalid allocation order %d\n", order);
+		return 0;
+	}
+
+	flags = spinlock_acquire_block(&page_lock);
+	k = page_find_block(order);
+
+	/*
+	A single page can come straight from the zero pool.  For a larger
+	block, the pool is given back in case that completes one.  Pages
+	released by shrinkers are scattered, so a large block may take
+	several rounds to come together: keep reclaiming for as long as
+	the shrinkers make progress.
+	*/
+
+	if(k > PAGE_ORDER_MAX && zero_pool_count > 0) {
+		if(order == 0) {
+			pageaddr = zero_pool[--zero_pool_count];
+			spinlock_release_restore(&page_lock, flags);
+			return pageaddr;
+		}
+		page_zero_drain();
+		k = page_find_block(order);
+	}
+
+	while(k > PAGE_ORDER_MAX) {
+		spinlock_release_restore(&page_lock, flags);
+		if(!page_reclaim(1 << order, 0)) {
+			printf("memory: WARNING: no free block of order %d\n", order);
+			return 0;
+		}
+		flags = spinlock_acquire_block(&page_lock);
+		k = page_find_block(order);
+	}
+
+	pfn = ADDR_TO_PFN(free_area[k].head);
+	page_block_remove(pfn);
+
+	// return the upper halves to the free lists until the block fits
+	while(k > order) {
+		k--;
+		page_block_insert(pfn + (1 << k), k);
+	}
+
+	struct page_frame *f = PFN_TO_FRAME(pfn);
+	f->order = order;
+	f->flags = PAGE_FRAME_ALLOC;
+	f->refcount = 1;
+
+	pages_free -= (1 << order);
+	low = pages_free < PAGE_RESERVE;
+
+	spinlock_release_restore(&page_lock, flags);
+
+	if(low)
+		work_queue(&workqueue_background, &reclaim_work);
+
+	pageaddr = PFN_TO_ADDR(pfn);
+	if(zeroit)
+		memset(pageaddr, 0, PAGE_SIZE << order);
+
+	return pageaddr;
+}
+
+/*
+In a profiling build, charge an allocated block to the call site
+of the public allocation function, and remember the site in its
+frame so that page_free can charge the block back to it.
+*/
+
+static void page_profile_alloc(void *pageaddr, void *site)
+{
+#ifdef ALLOC_PROFILE
+	if(pageaddr) {
+		struct page_frame *f = PFN_TO_FRAME(ADDR_TO_PFN(pageaddr));
+		f->site = site;
+		allocprof_alloc(ALLOCPROF_PAGE, site, PAGE_SIZE << f->order);
+	}
+#endif
+}
+
+void *page_alloc_order(unsigned order, bool zeroit)
+{
+	void *pageaddr = page_alloc_block(order, zeroit);
+	page_profile_alloc(pageaddr, __builtin_return_address(0));
+	return pageaddr;
+}
+
+void *page_alloc(bool zeroit)
+{
+	void *pageaddr = 0;
+
+	if(zeroit) {
+		int refill = 0;
+		uint32_t flags = spinlock_acquire_block(&page_lock);
+		if(zero_pool_count <= PAGE_ZERO_POOL_LOW && !zero_pool_refilling) {
+			zero_pool_refilling = 1;
+			refill = 1;
 		}
+		if(zero_pool_count > 0)
+			pageaddr = zero_pool[--zero_pool_count];
+		spinlock_release_restore(&page_lock, flags);
+		if(refill)
+			work_queue(&workqueue_background, &zero_work);
 	}
 
-	printf("memory: WARNING: everything allocated\n");
+	if(!pageaddr)
+		pageaddr = page_alloc_block(0, zeroit);
 
-	return 0;
+	page_profile_alloc(pageaddr, __builtin_return_address(0));
+	return pageaddr;
+}
+
+/*
+Clear one page into the zero pool, if the pool needs it,
+returning 1 if it did.
+*/
+
+static int page_zero_one()
+{
+	uint32_t flags = spinlock_acquire_block(&page_lock);
+	int wanted = frames && zero_pool_refilling;
+
+	// leave the last few free pages to page_alloc_order() itself
+	if(wanted && (zero_pool_count >= PAGE_ZERO_POOL_HIGH || pages_free <= PAGE_ZERO_POOL_HIGH)) {
+		zero_pool_refilling = 0;
+		wanted = 0;
+	}
+
+	spinlock_release_restore(&page_lock, flags);
+	if(!wanted)
+		return 0;
+
+	void *page = page_alloc_block(0, 1);
+
+	flags = spinlock_acquire_block(&page_lock);
+	if(page && zero_pool_count < PAGE_ZERO_POOL_HIGH) {
+		zero_pool[zero_pool_count++] = page;
+		page = 0;
+		wanted = 1;
+	} else {
+		zero_pool_refilling = 0;
+		wanted = 0;
+	}
+	spinlock_release_restore(&page_lock, flags);
+
+	if(page)
+		page_free(page);
+
+	return wanted;
+}
+
+static void page_zero_refill(struct work *w)
+{
+	int i;
+	for(i = 0; i < PAGE_ZERO_BATCH; i++) {
+		if(!page_zero_one())
+			return;
+	}
+	work_queue(&workqueue_background, w);
+}
+
+static struct page_frame *page_frame_lookup(void *pageaddr, const char *op)
+{
+	uint32_t pfn = ADDR_TO_PFN(pageaddr);
+
+	if(pfn < first_pfn || pfn >= last_pfn) {
+		printf("memory: invalid %s(%x)\n", op, pageaddr);
+		return 0;
+	}
+
+	struct page_frame *f = PFN_TO_FRAME(pfn);
+	if(f->flags != PAGE_FRAME_ALLOC) {
+		printf("memory: %s(%x) of unallocated block\n", op, pageaddr);
+		return 0;
+	}
+
+	return f;
+}
+
+void page_addref(void *pageaddr)
+{
+	uint32_t flags = spinlock_acquire_block(&page_lock);
+	struct page_frame *f = page_frame_lookup(pageaddr, "page_addref");
+	if(f && f->refcount < PAGE_REFCOUNT_MAX) {
+		f->refcount++;
+		if(f->refcount == PAGE_REFCOUNT_MAX)
+			printf("memory: WARNING: page_addref(%x) saturated, page will never be freed\n", pageaddr);
+	}
+	spinlock_release_restore(&page_lock, flags);
+}
+
+int page_refcount(void *pageaddr)
+{
+	uint32_t flags = spinlock_acquire_block(&page_lock);
+	struct page_frame *f = page_frame_lookup(pageaddr, "page_refcount");
+	int refcount = f ? f->refcount : 0;
+	spinlock_release_restore(&page_lock, flags);
+	return refcount;
 }
 
 void page_free(void *pageaddr)
 {
-	uint32_t pagenumber = (pageaddr - main_memory_start) >> PAGE_BITS;
-	uint32_t cellnumber = pagenumber / CELL_BITS;
-	uint32_t celloffset = pagenumber % CELL_BITS;
-	uint32_t cellmask = (1 << celloffset);
-	freemap[cellnumber] |= cellmask;
-	pages_free++;
-	//printf("page: free %d\n",pages_free);
+	uint32_t flags = spinlock_acquire_block(&page_lock);
+	struct page_frame *f = page_frame_lookup(pageaddr, "page_free");
+	if(!f) {
+		spinlock_release_restore(&page_lock, flags);
+		return;
+	}
+
+	if(f->refcount < PAGE_REFCOUNT_MAX)
+		f->refcount--;
+	if(f->refcount > 0) {
+		spinlock_release_restore(&page_lock, flags);
+		return;
+	}
+
+	uint32_t pfn = ADDR_TO_PFN(pageaddr);
+	unsigned order = f->order;
+	f->flags = 0;
+
+#ifdef ALLOC_PROFILE
+	void *site = f->site;
+#endif
+	pages_free += (1 << order);
+	page_block_release(pfn, order);
+
+	spinlock_release_restore(&page_lock, flags);
+
+#ifdef ALLOC_PROFILE
+	allocprof_free(ALLOCPROF_PAGE, site, PAGE_SIZE << order);
+#endif
 }
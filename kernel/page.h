@@ -9,9 +9,43 @@ See the file LICENSE for details.
 
 #include "kernel/types.h"
 
+/*
+The largest block handed out by page_alloc_order(),
+as a power of two number of pages: 2^10 pages = 4MB.
+*/
+
+#define PAGE_ORDER_MAX 10
+
+/*
+A shrinker is a cache that can give pages back to the allocator.
+Under memory pressure, the allocator calls each registered
+shrinker in order of registration, asking it to release some pages,
+and the shrinker returns how many it actually released.
+can_block is set only when called from the background work queue:
+otherwise the shrinker is called in the middle of an allocation,
+and must release what it can without waiting for a device.
+Shrinkers are declared statically with PAGE_SHRINKER_INIT.
+*/
+
+typedef unsigned (*page_shrink_t) (unsigned npages, int can_block);
+
+struct page_shrinker {
+	const char *name;
+	page_shrink_t shrink;
+	int active;
+	struct page_shrinker *next;
+};
+
+#define PAGE_SHRINKER_INIT(name,shrink) {name,shrink,0,0}
+
+void  page_shrinker_register(struct page_shrinker *s);
+
 void  page_init();
 void *page_alloc(bool zeroit);
+void *page_alloc_order(unsigned order, bool zeroit);
 void  page_free(void *addr);
-void  page_stats( uint32_t *nfree, uint32_t *ntotal );
+void  page_addref(void *addr);
+int   page_refcount(void *addr);
+void  page_stats( uint32_t *nfree, uint32_t *ntotal, uint32_t *nblocks );
 
 #endif
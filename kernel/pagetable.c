@@ -8,9 +8,32 @@ See the file LICENSE for details.
 #include "page.h"
 #include "string.h"
 #include "kernelcore.h"
+#include "memorylayout.h"
+#include "zram.h"
+#include "swap.h"
+#include "lapic.h"
+#include "cpu.h"
 
 #define ENTRIES_PER_TABLE (PAGE_SIZE/4)
 
+/*
+The avail bits of a page entry are ours to use:
+PAGE_AVAIL_ALLOC marks a page allocated for (and freed with) this table,
+PAGE_AVAIL_COW marks a page shared copy-on-write after a fork.
+In an entry that is not present, PAGE_AVAIL_ZERO marks a page
+that has been reserved but not yet touched: the page fault handler
+maps a fresh zeroed page there on first access.  PAGE_AVAIL_ZRAM
+marks a page whose contents were moved to the compressed store,
+and PAGE_AVAIL_SWAP a page written out to the swap area, with the
+store's handle or the swap slot kept in place of the page address.
+*/
+
+#define PAGE_AVAIL_ALLOC 0x01
+#define PAGE_AVAIL_COW   0x02
+#define PAGE_AVAIL_ZERO  0x04
+#define PAGE_AVAIL_ZRAM  0x01
+#define PAGE_AVAIL_SWAP  0x02
+
 struct pageentry {
 	unsigned present:1;	// 1 = present
 	unsigned readwrite:1;	// 1 = writable
@@ -32,21 +55,172 @@ struct pagetable {
 	struct pageentry entry[ENTRIES_PER_TABLE];
 };
 
+/*
+The kernel mappings (physical memory, the video buffer and the
+registers of the local APIC, all identity mapped) are the same
+in every address space.  They are
+built once, in kernel_pagetable, and each new page directory
+simply copies the kernel's directory entries.  Where the processor
+supports it, each entry maps a 4MB large page marked global, so
+that no second level tables are needed and the kernel's TLB entries
+survive address space switches.  Otherwise, the entries point to
+second level tables that are shared by every address space.
+Either way, entries present in kernel_pagetable belong to the
+kernel, and are never copied or freed along with a process.
+The registers of the local APIC must not be cached, so they always
+get a 4KB entry of their own, marked uncached and write-through.
+*/
+
+#define CPUID_FEATURE_PSE (1<<3)
+#define CPUID_FEATURE_PGE (1<<13)
+
+#define CR4_PSE (1<<4)
+#define CR4_PGE (1<<7)
+
+static struct pagetable *kernel_pagetable = 0;
+static uint32_t cpu_features = 0;
+
+static struct pageentry *pagetable_entry(struct pagetable *p, unsigned vaddr, int create, int flags);
+static void pagetable_entry_set(struct pageentry *e, unsigned paddr, int flags);
+
+static int pagetable_is_kernel(unsigned a)
+{
+	return kernel_pagetable && kernel_pagetable->entry[a].present;
+}
+
+static int pagetable_is_loaded(struct pagetable *p)
+{
+	struct pagetable *loaded;
+	asm("mov %%cr3, %0":"=r"(loaded));
+	return loaded == p;
+}
+
 struct pagetable *pagetable_create()
 {
 	return page_alloc(1);
 }
 
-void pagetable_init(struct pagetable *p)
+static void pagetable_kernel_map(unsigned start, unsigned stop)
+{
+	unsigned i;
+
+	if(cpu_features & CPUID_FEATURE_PSE) {
+		for(i = start >> 22; i <= (stop - 1) >> 22; i++) {
+			struct pageentry *e = &kernel_pagetable->entry[i];
+			e->present = 1;
+			e->readwrite = 1;
+			e->user = 0;
+			e->pagesize = 1;
+			e->globalpage = 1;
+			e->addr = i << 10;
+		}
+	} else {
+		pagetable_map_range(kernel_pagetable, start, start, stop - start, PAGE_FLAG_KERNEL | PAGE_FLAG_READWRITE);
+	}
+}
+
+/*
+Map one page of device registers, uncached.  If the page falls within
+a large page already mapped for memory or the video buffer, the whole
+large page has to be left uncached instead.
+*/
+
+static void pagetable_kernel_map_device(unsigned paddr)
 {
-	unsigned i, stop;
-	stop = total_memory * 1024 * 1024;
-	for(i = 0; i < stop; i += PAGE_SIZE) {
-		pagetable_map(p, i, i, PAGE_FLAG_KERNEL | PAGE_FLAG_READWRITE);
+	struct pageentry *e = pagetable_entry(kernel_pagetable, paddr, 1, PAGE_FLAG_KERNEL);
+
+	if(!e) {
+		e = &kernel_pagetable->entry[paddr >> 22];
+		if(!e->pagesize) {
+			printf("memory: couldn't map device at %x\n", paddr);
+			return;
+		}
+	} else {
+		pagetable_entry_set(e, paddr, PAGE_FLAG_KERNEL | PAGE_FLAG_READWRITE);
 	}
-	stop = (unsigned) video_buffer + video_xres * video_yres * 3;
-	for(i = (unsigned) video_buffer; i <= stop; i += PAGE_SIZE) {
-		pagetable_map(p, i, i, PAGE_FLAG_KERNEL | PAGE_FLAG_READWRITE);
+
+	e->writethrough = 1;
+	e->nocache = 1;
+}
+
+static void pagetable_kernel_init()
+{
+	uint32_t eax, ebx, ecx;
+	asm("cpuid":"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(cpu_features):"a"(1));
+
+	kernel_pagetable = pagetable_create();
+
+	pagetable_kernel_map(0, total_memory * 1024 * 1024);
+	pagetable_kernel_map((unsigned) video_buffer, (unsigned) video_buffer + video_xres * video_yres * 3);
+	if(lapic_address())
+		pagetable_kernel_map_device(lapic_address());
+
+	/*
+	The second level tables of the vmalloc range are created up front,
+	so that every address space shares them, and pages mapped there
+	later are seen by all processes without touching their directories.
+	*/
+
+	unsigned vaddr;
+	for(vaddr = KERNEL_VMALLOC_START; vaddr < KERNEL_VMALLOC_END; vaddr += PAGE_SIZE * ENTRIES_PER_TABLE) {
+		pagetable_entry(kernel_pagetable, vaddr, 1, PAGE_FLAG_KERNEL);
+	}
+}
+
+/*
+The kernel's own directory, with nothing but the kernel mappings,
+for processors that have no process to run.
+*/
+
+struct pagetable *pagetable_kernel()
+{
+	if(!kernel_pagetable)
+		pagetable_kernel_init();
+	return kernel_pagetable;
+}
+
+/*
+Map or unmap a page in the kernel's vmalloc range, in every address space.
+Unmapping returns the physical address of the page that was there, if any.
+*/
+
+int pagetable_map_kernel(unsigned vaddr, unsigned paddr)
+{
+	if(!kernel_pagetable)
+		pagetable_kernel_init();
+
+	if(vaddr < KERNEL_VMALLOC_START || vaddr >= KERNEL_VMALLOC_END)
+		return 0;
+
+	return pagetable_map(kernel_pagetable, vaddr, paddr, PAGE_FLAG_KERNEL | PAGE_FLAG_READWRITE);
+}
+
+unsigned pagetable_unmap_kernel(unsigned vaddr)
+{
+	unsigned paddr;
+
+	if(vaddr < KERNEL_VMALLOC_START || vaddr >= KERNEL_VMALLOC_END)
+		return 0;
+	if(!pagetable_getmap(kernel_pagetable, vaddr, &paddr, 0))
+		return 0;
+
+	pagetable_unmap(kernel_pagetable, vaddr);
+	asm("invlpg (%0)"::"r"(vaddr):"memory");
+	cpu_tlb_shootdown();
+
+	return paddr;
+}
+
+void pagetable_init(struct pagetable *p)
+{
+	unsigned i;
+
+	if(!kernel_pagetable)
+		pagetable_kernel_init();
+
+	for(i = 0; i < ENTRIES_PER_TABLE; i++) {
+		if(kernel_pagetable->entry[i].present)
+			p->entry[i] = kernel_pagetable->entry[i];
 	}
 }
 
@@ -62,20 +236,26 @@ int pagetable_getmap(struct pagetable *p, unsigned vaddr, unsigned *paddr, int *
 	if(!e->present)
 		return 0;
 
-	q = (struct pagetable *) (e->addr << 12);
+	if(e->pagesize) {
+		*paddr = (e->addr << 12) + (vaddr & 0x3ff000);
+	} else {
+		q = (struct pagetable *) (e->addr << 12);
 
-	e = &q->entry[b];
-	if(!e->present)
-		return 0;
+		e = &q->entry[b];
+		if(!e->present)
+			return 0;
 
-	*paddr = e->addr << 12;
+		*paddr = e->addr << 12;
+	}
 
 	if(flags) {
 		*flags = 0;
 		if(e->readwrite)
 			*flags |= PAGE_FLAG_READWRITE;
-		if(e->avail & 0x01)
+		if(e->avail & PAGE_AVAIL_ALLOC)
 			*flags |= PAGE_FLAG_ALLOC;
+		if(e->avail & PAGE_AVAIL_COW)
+			*flags |= PAGE_FLAG_COW;
 		if(!e->user)
 			*flags |= PAGE_FLAG_KERNEL;
 	}
@@ -83,7 +263,12 @@ int pagetable_getmap(struct pagetable *p, unsigned vaddr, unsigned *paddr, int *
 	return 1;
 }
 
-int pagetable_map(struct pagetable *p, unsigned vaddr, unsigned paddr, int flags)
+/*
+Return the second level entry for vaddr, creating the
+second level table with the given flags if create is set.
+*/
+
+static struct pageentry *pagetable_entry(struct pagetable *p, unsigned vaddr, int create, int flags)
 {
 	struct pagetable *q;
 	struct pageentry *e;
@@ -91,15 +276,14 @@ int pagetable_map(struct pagetable *p, unsigned vaddr, unsigned paddr, int flags
 	unsigned a = vaddr >> 22;
 	unsigned b = (vaddr >> 12) & 0x3ff;
 
-	if(flags & PAGE_FLAG_ALLOC) {
-		paddr = (unsigned) page_alloc(flags & PAGE_FLAG_CLEAR);
-		if(!paddr)
-			return 0;
-	}
-
 	e = &p->entry[a];
 
+	if(e->pagesize)
+		return 0;
+
 	if(!e->present) {
+		if(!create)
+			return 0;
 		q = pagetable_create();
 		if(!q)
 			return 0;
@@ -118,9 +302,11 @@ int pagetable_map(struct pagetable *p, unsigned vaddr, unsigned paddr, int flags
 		q = (struct pagetable *) (((unsigned) e->addr) << 12);
 	}
 
+	return &q->entry[b];
+}
 
-	e = &q->entry[b];
-
+static void pagetable_entry_set(struct pageentry *e, unsigned paddr, int flags)
+{
 	e->present = 1;
 	e->readwrite = (flags & PAGE_FLAG_READWRITE) ? 1 : 0;
 	e->user = (flags & PAGE_FLAG_KERNEL) ? 0 : 1;
@@ -130,9 +316,35 @@ int pagetable_map(struct pagetable *p, unsigned vaddr, unsigned paddr, int flags
 	e->dirty = 0;
 	e->pagesize = 0;
 	e->globalpage = !e->user;
-	e->avail = (flags & PAGE_FLAG_ALLOC) ? 1 : 0;
+	e->avail = (flags & PAGE_FLAG_ALLOC) ? PAGE_AVAIL_ALLOC : 0;
 	e->addr = (paddr >> 12);
 
+	// the table takes over a reference to a page shared copy-on-write
+	if(flags & PAGE_FLAG_COW) {
+		e->readwrite = 0;
+		e->avail = PAGE_AVAIL_ALLOC | PAGE_AVAIL_COW;
+	}
+}
+
+int pagetable_map(struct pagetable *p, unsigned vaddr, unsigned paddr, int flags)
+{
+	struct pageentry *e;
+
+	if(flags & PAGE_FLAG_ALLOC) {
+		paddr = (unsigned) page_alloc(flags & PAGE_FLAG_CLEAR);
+		if(!paddr)
+			return 0;
+	}
+
+	e = pagetable_entry(p, vaddr, 1, flags);
+	if(!e) {
+		if(flags & PAGE_FLAG_ALLOC)
+			page_free((void *) paddr);
+		return 0;
+	}
+
+	pagetable_entry_set(e, paddr, flags);
+
 	return 1;
 }
 
@@ -145,13 +357,38 @@ void pagetable_unmap(struct pagetable *p, unsigned vaddr)
 	unsigned b = vaddr >> 12 & 0x3ff;
 
 	e = &p->entry[a];
-	if(e->present) {
+	if(e->present && !e->pagesize) {
 		q = (struct pagetable *) (e->addr << 12);
 		e = &q->entry[b];
 		e->present = 0;
+		e->avail = 0;
+		if(pagetable_is_loaded(p))
+			asm("invlpg (%0)"::"r"(vaddr):"memory");
 	}
 }
 
+/*
+A page entry that is not present may name a page held elsewhere,
+in the compressed store or the swap area, which is released or shared
+along with the entry, just as pages are for present entries.
+*/
+
+static void pagetable_stored_free(struct pageentry *e)
+{
+	if(e->avail == PAGE_AVAIL_ZRAM)
+		zram_free(e->addr);
+	else if(e->avail == PAGE_AVAIL_SWAP)
+		swap_free(e->addr);
+}
+
+static void pagetable_stored_addref(struct pageentry *e)
+{
+	if(e->avail == PAGE_AVAIL_ZRAM)
+		zram_addref(e->addr);
+	else if(e->avail == PAGE_AVAIL_SWAP)
+		swap_addref(e->addr);
+}
+
 void pagetable_delete(struct pagetable *p)
 {
 	unsigned i, j;
@@ -161,7 +398,7 @@ void pagetable_delete(struct pagetable *p)
 
 	for(i = 0; i < ENTRIES_PER_TABLE; i++) {
 		e = &p->entry[i];
-		if(e->present) {
+		if(e->present && !pagetable_is_kernel(i)) {
 			q = (struct pagetable *) (e->addr << 12);
 			for(j = 0; j < ENTRIES_PER_TABLE; j++) {
 				e = &q->entry[j];
@@ -169,6 +406,8 @@ void pagetable_delete(struct pagetable *p)
 					void *paddr;
 					paddr = (void *) (e->addr << 12);
 					page_free(paddr);
+				} else if(!e->present) {
+					pagetable_stored_free(e);
 				}
 			}
 			page_free(q);
@@ -178,47 +417,219 @@ void pagetable_delete(struct pagetable *p)
 	page_free(p);
 }
 
-void pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int flags)
+/*
+The range operations below visit one second level table at a time:
+pagetable_entry is consulted once for each table touched by the range,
+and the following entries of the same table are reached by
+simply advancing the pointer.  pagetable_span gives the
+number of pages of the range that fall within the current table.
+*/
+
+static unsigned pagetable_span(unsigned vaddr, unsigned npages)
 {
-	unsigned npages = length / PAGE_SIZE;
+	unsigned left = ENTRIES_PER_TABLE - ((vaddr >> 12) & 0x3ff);
+	return MIN(npages, left);
+}
+
+static unsigned pagetable_npages(unsigned vaddr, unsigned length)
+{
+	return ((vaddr & ~PAGE_MASK) + length + PAGE_SIZE - 1) / PAGE_SIZE;
+}
 
-	if(length % PAGE_SIZE)
-		npages++;
+/*
+Drop stale TLB entries for pages whose mappings were removed or
+restricted.  Only needed if the table is the one currently loaded,
+since loading a table flushes every non-global entry anyway.
+Past a handful of pages, a single reload of CR3 is cheaper
+than invalidating each page on its own.
+*/
 
-	vaddr &= 0xfffff000;
+#define PAGETABLE_INVLPG_MAX 32
+
+static void pagetable_invalidate(struct pagetable *p, unsigned vaddr, unsigned npages)
+{
+	if(!pagetable_is_loaded(p))
+		return;
+
+	if(npages > PAGETABLE_INVLPG_MAX) {
+		pagetable_refresh();
+		return;
+	}
 
 	while(npages > 0) {
-		unsigned paddr;
-		if(!pagetable_getmap(p, vaddr, &paddr, 0)) {
-			pagetable_map(p, vaddr, 0, flags | PAGE_FLAG_ALLOC);
-		}
+		asm("invlpg (%0)"::"r"(vaddr):"memory");
 		vaddr += PAGE_SIZE;
 		npages--;
 	}
 }
 
-void pagetable_free(struct pagetable *p, unsigned vaddr, unsigned length)
+/*
+Map a range of virtual addresses onto a contiguous range of
+physical addresses, or onto newly allocated pages if PAGE_FLAG_ALLOC is given.
+Returns 1 on success, or 0 if a page or table could not be allocated,
+in which case the part of the range already mapped stays mapped.
+*/
+
+int pagetable_map_range(struct pagetable *p, unsigned vaddr, unsigned paddr, unsigned length, int flags)
 {
-	unsigned npages = length / PAGE_SIZE;
+	unsigned npages = pagetable_npages(vaddr, length);
+
+	vaddr &= PAGE_MASK;
+	paddr &= PAGE_MASK;
+
+	while(npages > 0) {
+		unsigned n = pagetable_span(vaddr, npages);
+		struct pageentry *e = pagetable_entry(p, vaddr, 1, flags);
+		if(!e)
+			return 0;
 
-	if(length % PAGE_SIZE)
-		npages++;
+		unsigned i;
+		for(i = 0; i < n; i++, e++) {
+			unsigned addr = paddr;
+			if(flags & PAGE_FLAG_ALLOC) {
+				addr = (unsigned) page_alloc(flags & PAGE_FLAG_CLEAR);
+				if(!addr)
+					return 0;
+			}
+			pagetable_entry_set(e, addr, flags);
+			paddr += PAGE_SIZE;
+		}
 
-	vaddr &= 0xfffff000;
+		vaddr += n * PAGE_SIZE;
+		npages -= n;
+	}
+
+	return 1;
+}
+
+void pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int flags)
+{
+	unsigned npages = pagetable_npages(vaddr, length);
+
+	vaddr &= PAGE_MASK;
 
 	while(npages > 0) {
-		unsigned paddr;
-		int flags;
-		if(pagetable_getmap(p, vaddr, &paddr, &flags)) {
-			pagetable_unmap(p, vaddr);
-			if(flags & PAGE_FLAG_ALLOC)
-				page_free((void *) paddr);
+		unsigned n = pagetable_span(vaddr, npages);
+		struct pageentry *e = pagetable_entry(p, vaddr, 1, flags);
+		if(!e)
+			return;
+
+		unsigned i;
+		for(i = 0; i < n; i++, e++) {
+			if(e->present || e->avail == PAGE_AVAIL_ZRAM || e->avail == PAGE_AVAIL_SWAP)
+				continue;
+			unsigned paddr = (unsigned) page_alloc(flags & PAGE_FLAG_CLEAR);
+			if(!paddr)
+				return;
+			pagetable_entry_set(e, paddr, flags | PAGE_FLAG_ALLOC);
 		}
-		vaddr += PAGE_SIZE;
-		npages--;
+
+		vaddr += n * PAGE_SIZE;
+		npages -= n;
 	}
 }
 
+/*
+Reserve the pages covering a range without allocating them.
+Each untouched page in the range is marked demand-zero,
+and is allocated and cleared by pagetable_demand_fault
+when the process first touches it.  Nothing present changes,
+so no TLB entries need to be invalidated.
+*/
+
+void pagetable_reserve(struct pagetable *p, unsigned vaddr, unsigned length, int flags)
+{
+	unsigned npages = pagetable_npages(vaddr, length);
+
+	vaddr &= PAGE_MASK;
+
+	while(npages > 0) {
+		unsigned n = pagetable_span(vaddr, npages);
+		struct pageentry *e = pagetable_entry(p, vaddr, 1, flags);
+		if(!e)
+			return;
+
+		unsigned i;
+		for(i = 0; i < n; i++, e++) {
+			if(!e->present && !e->avail) {
+				memset(e, 0, sizeof(*e));
+				e->readwrite = (flags & PAGE_FLAG_READWRITE) ? 1 : 0;
+				e->user = (flags & PAGE_FLAG_KERNEL) ? 0 : 1;
+				e->avail = PAGE_AVAIL_ZERO;
+			}
+		}
+
+		vaddr += n * PAGE_SIZE;
+		npages -= n;
+	}
+}
+
+/*
+Resolve a fault on a page reserved by pagetable_reserve,
+by mapping a newly allocated zeroed page in its place.
+Returns 1 if the page was reserved and is now mapped.
+*/
+
+int pagetable_demand_fault(struct pagetable *p, unsigned vaddr)
+{
+	struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+	if(!e || e->present || !(e->avail & PAGE_AVAIL_ZERO))
+		return 0;
+
+	void *paddr = page_alloc(1);
+	if(!paddr)
+		return 0;
+
+	e->present = 1;
+	e->avail = PAGE_AVAIL_ALLOC;
+	e->addr = (((unsigned) paddr) >> 12);
+
+	return 1;
+}
+
+/*
+Unmap a range, freeing the pages that were allocated for it
+and dropping any reservations that were never touched.
+If the table is loaded, the TLB entries of the pages
+that were actually mapped are invalidated.
+*/
+
+void pagetable_free(struct pagetable *p, unsigned vaddr, unsigned length)
+{
+	unsigned npages = pagetable_npages(vaddr, length);
+	unsigned start = vaddr & PAGE_MASK;
+	unsigned first = 0, count = 0;
+
+	vaddr = start;
+
+	while(npages > 0) {
+		unsigned n = pagetable_span(vaddr, npages);
+		struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+
+		unsigned i;
+		for(i = 0; e && i < n; i++, e++) {
+			if(e->present) {
+				if(e->avail & PAGE_AVAIL_ALLOC)
+					page_free((void *) (e->addr << 12));
+				unsigned page = vaddr + i * PAGE_SIZE;
+				if(!count)
+					first = page;
+				count = (page - first) / PAGE_SIZE + 1;
+			} else {
+				pagetable_stored_free(e);
+			}
+			e->present = 0;
+			e->avail = 0;
+		}
+
+		vaddr += n * PAGE_SIZE;
+		npages -= n;
+	}
+
+	if(count)
+		pagetable_invalidate(p, first, count);
+}
+
 struct pagetable *pagetable_load(struct pagetable *p)
 {
 	struct pagetable *oldp;
@@ -233,13 +644,54 @@ void pagetable_refresh()
 	asm("mov %eax, %cr3");
 }
 
+/*
+Reloading CR3 leaves the global kernel pages in the TLB,
+so turn global pages off and on again to flush those as well.
+*/
+
+void pagetable_refresh_global()
+{
+	uint32_t cr4;
+	asm volatile("movl %%cr4, %0":"=r"(cr4));
+	if(cr4 & CR4_PGE) {
+		asm volatile("movl %0, %%cr4"::"r"(cr4 & ~CR4_PGE):"memory");
+		asm volatile("movl %0, %%cr4"::"r"(cr4):"memory");
+	} else {
+		pagetable_refresh();
+	}
+}
+
+/*
+Besides paging itself, turn on the write protect bit (0x10000),
+so that kernel writes into user memory also honor read-only
+pages and trigger copy-on-write just like user writes do.
+Large and global pages are enabled in CR4 if the processor has them.
+*/
+
 void pagetable_enable()
 {
+	uint32_t cr4;
+	asm("movl %%cr4, %0":"=r"(cr4));
+	if(cpu_features & CPUID_FEATURE_PSE)
+		cr4 |= CR4_PSE;
+	if(cpu_features & CPUID_FEATURE_PGE)
+		cr4 |= CR4_PGE;
+	asm("movl %0, %%cr4"::"r"(cr4));
+
 	asm("movl %cr0, %eax");
-	asm("orl $0x80000000, %eax");
+	asm("orl $0x80010000, %eax");
 	asm("movl %eax, %cr0");
 }
 
+/*
+pagetable_duplicate does not copy the pages allocated to
+the source table.  Instead, each one is shared by both tables,
+marked read-only and copy-on-write in both, and its reference
+count raised.  The first write through either table faults,
+and pagetable_cow_fault gives the writer a private copy.
+The caller must flush the TLB if the source table is loaded.
+*/
+
 struct pagetable *pagetable_duplicate(struct pagetable *sp)
 {
 	unsigned i, j;
@@ -256,7 +708,9 @@ struct pagetable *pagetable_duplicate(struct pagetable *sp)
 	for(i = 0; i < ENTRIES_PER_TABLE; i++) {
 		e = &sp->entry[i];
 		newe = &newp->entry[i];
-		if(e->present) {
+		if(pagetable_is_kernel(i)) {
+			memcpy(newe, e, sizeof(struct pageentry));
+		} else if(e->present) {
 			q = (struct pagetable *) (e->addr << 12);
 			newq = pagetable_create();
 			if(!newq)
@@ -266,21 +720,16 @@ struct pagetable *pagetable_duplicate(struct pagetable *sp)
 			for(j = 0; j < ENTRIES_PER_TABLE; j++) {
 				e = &q->entry[j];
 				newe = &newq->entry[j];
-				memcpy(newe, e, sizeof(struct pageentry));
-				if(e->present) {
-					void *paddr;
-					paddr = (void *) (e->addr << 12);
-					void *new_paddr = 0;
-					if(e->avail) {
-						new_paddr = page_alloc(0);
-						if(!new_paddr)
-							goto cleanup;
-						memcpy(new_paddr, paddr, PAGE_SIZE);
-					} else {
-						new_paddr = paddr;
+				if(e->present && (e->avail & PAGE_AVAIL_ALLOC)) {
+					if(e->readwrite) {
+						e->readwrite = 0;
+						e->avail |= PAGE_AVAIL_COW;
 					}
-					newe->addr = (((unsigned) new_paddr) >> 12);
+					page_addref((void *) (e->addr << 12));
+				} else if(!e->present) {
+					pagetable_stored_addref(e);
 				}
+				memcpy(newe, e, sizeof(struct pageentry));
 			}
 		}
 	}
@@ -293,4 +742,283 @@ struct pagetable *pagetable_duplicate(struct pagetable *sp)
 	return 0;
 }
 
+/*
+Resolve a write fault on a copy-on-write page.  If this table holds
+the last reference to the page, it is simply made writable again.
+Otherwise, the contents are copied into a fresh private page,
+and the reference to the shared page is dropped.
+Returns 1 if the fault was a copy-on-write fault and was resolved.
+*/
+
+int pagetable_cow_fault(struct pagetable *p, unsigned vaddr)
+{
+	struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+	if(!e || !e->present || !(e->avail & PAGE_AVAIL_COW))
+		return 0;
+
+	void *paddr = (void *) (e->addr << 12);
+
+	if(page_refcount(paddr) > 1) {
+		void *new_paddr = page_alloc(0);
+		if(!new_paddr)
+			return 0;
+		memcpy(new_paddr, paddr, PAGE_SIZE);
+		page_free(paddr);
+		e->addr = (((unsigned) new_paddr) >> 12);
+	}
+
+	e->readwrite = 1;
+	e->avail &= ~PAGE_AVAIL_COW;
+
+	asm("invlpg (%0)"::"r"(vaddr):"memory");
+
+	return 1;
+}
+
+/*
+Find the first private, writable page at or above *vaddr (and below end)
+that was allocated for this table, returning its virtual and physical
+address.  Pages already shared copy-on-write are passed over.
+Missing second level tables and kernel entries are skipped whole.
+Returns 0 if there is no such page.
+*/
+
+int pagetable_next_private(struct pagetable *p, unsigned *vaddr, unsigned end, unsigned *paddr)
+{
+	unsigned v = *vaddr & PAGE_MASK;
+
+	while(v < end) {
+		unsigned a = v >> 22;
+		struct pageentry *e = &p->entry[a];
+
+		if(!e->present || e->pagesize || pagetable_is_kernel(a)) {
+			v = (a + 1) << 22;
+			if(!v)
+				break;
+			continue;
+		}
+
+		struct pagetable *q = (struct pagetable *) (e->addr << 12);
+		unsigned b;
+		for(b = (v >> 12) & 0x3ff; b < ENTRIES_PER_TABLE && v < end; b++, v += PAGE_SIZE) {
+			e = &q->entry[b];
+			if(e->present && e->readwrite && (e->avail & PAGE_AVAIL_ALLOC)) {
+				*vaddr = v;
+				*paddr = e->addr << 12;
+				return 1;
+			}
+		}
+		if(!v)
+			break;
+	}
+
+	return 0;
+}
+
+/*
+Clear the dirty bit of a page, returning whether it was set.
+A page that stays clean between two calls has not been written.
+*/
+
+int pagetable_clear_dirty(struct pagetable *p, unsigned vaddr)
+{
+	struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+	if(!e || !e->present || !e->dirty)
+		return 0;
+
+	e->dirty = 0;
+	if(pagetable_is_loaded(p))
+		asm("invlpg (%0)"::"r"(vaddr):"memory");
+
+	return 1;
+}
+
+/*
+Clear the accessed bit of a page, returning whether it was set.
+*/
+
+int pagetable_clear_accessed(struct pagetable *p, unsigned vaddr)
+{
+	struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+	if(!e || !e->present || !e->accessed)
+		return 0;
+
+	e->accessed = 0;
+	if(pagetable_is_loaded(p))
+		asm("invlpg (%0)"::"r"(vaddr):"memory");
+
+	return 1;
+}
+
+/*
+Move a private page into the compressed store and release it,
+leaving the store's handle in the entry.  The page is faulted
+back in by pagetable_zram_fault when the process next touches it.
+Returns 1 if the page was stored and released.
+*/
+
+int pagetable_compress(struct pagetable *p, unsigned vaddr)
+{
+	struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+	if(!e || !e->present || e->avail != PAGE_AVAIL_ALLOC)
+		return 0;
+
+	void *paddr = (void *) (e->addr << 12);
+	if(page_refcount(paddr) != 1)
+		return 0;
+
+	uint32_t handle;
+	if(!zram_store(paddr, &handle))
+		return 0;
+
+	e->present = 0;
+	e->avail = PAGE_AVAIL_ZRAM;
+	e->addr = handle;
+
+	if(pagetable_is_loaded(p))
+		asm("invlpg (%0)"::"r"(vaddr):"memory");
+
+	page_free(paddr);
+	return 1;
+}
+
+/*
+Resolve a fault on a page held in the compressed store,
+by decompressing it into a newly allocated page.
+Returns 1 if the page was compressed and is now mapped.
+*/
+
+int pagetable_zram_fault(struct pagetable *p, unsigned vaddr)
+{
+	struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+	if(!e || e->present || e->avail != PAGE_AVAIL_ZRAM)
+		return 0;
+
+	void *paddr = page_alloc(0);
+	if(!paddr)
+		return 0;
+
+	if(!zram_load(e->addr, paddr)) {
+		page_free(paddr);
+		return 0;
+	}
+
+	zram_free(e->addr);
+
+	e->present = 1;
+	e->avail = PAGE_AVAIL_ALLOC;
+	e->addr = (((unsigned) paddr) >> 12);
+
+	return 1;
+}
+
+/*
+Make a private page read-only and copy-on-write, returning its address,
+so that it can be written out while any write by the process is
+noticed: pagetable_cow_fault makes the page writable again.
+*/
+
+int pagetable_write_protect(struct pagetable *p, unsigned vaddr, unsigned *paddr)
+{
+	struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+	if(!e || !e->present || e->avail != PAGE_AVAIL_ALLOC)
+		return 0;
+
+	e->readwrite = 0;
+	e->avail |= PAGE_AVAIL_COW;
+
+	if(pagetable_is_loaded(p))
+		asm("invlpg (%0)"::"r"(vaddr):"memory");
+
+	*paddr = e->addr << 12;
+	return 1;
+}
+
+/*
+Replace a page protected by pagetable_write_protect with the swap
+slot that now holds its contents, and release the page.  Returns 0
+if the entry has changed since, because the page was written to
+or unmapped while the slot was being written.
+*/
+
+int pagetable_swap_out(struct pagetable *p, unsigned vaddr, unsigned paddr, unsigned slot)
+{
+	struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+	if(!e || !e->present || e->readwrite || e->avail != (PAGE_AVAIL_ALLOC | PAGE_AVAIL_COW) || (e->addr << 12) != paddr)
+		return 0;
+
+	e->present = 0;
+	e->avail = PAGE_AVAIL_SWAP;
+	e->addr = slot;
+
+	if(pagetable_is_loaded(p))
+		asm("invlpg (%0)"::"r"(vaddr):"memory");
+
+	page_free((void *) paddr);
+	return 1;
+}
+
+/*
+Return the swap slot of a page that has been swapped out.
+*/
+
+int pagetable_swap_entry(struct pagetable *p, unsigned vaddr, unsigned *slot)
+{
+	struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+	if(!e || e->present || e->avail != PAGE_AVAIL_SWAP)
+		return 0;
+
+	*slot = e->addr;
+	return 1;
+}
+
+/*
+Map a page read back from a swap slot in place of the slot,
+and release the table's reference to the slot.  Returns 0 if the
+entry no longer names the slot, in which case the page is unused.
+*/
+
+int pagetable_swap_in(struct pagetable *p, unsigned vaddr, unsigned slot, unsigned paddr)
+{
+	struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+	if(!e || e->present || e->avail != PAGE_AVAIL_SWAP || e->addr != slot)
+		return 0;
+
+	e->present = 1;
+	e->avail = PAGE_AVAIL_ALLOC;
+	e->addr = paddr >> 12;
+
+	swap_free(slot);
+	return 1;
+}
+
+/*
+Make an allocated page read-only and copy-on-write, backed by paddr.
+If paddr is the page already mapped, it is only write protected.
+Otherwise the table takes a new reference to paddr, and drops its
+reference to the old page.  Used to merge pages of identical content.
+*/
+
+int pagetable_share(struct pagetable *p, unsigned vaddr, unsigned paddr)
+{
+	struct pageentry *e = pagetable_entry(p, vaddr, 0, 0);
+	if(!e || !e->present || !(e->avail & PAGE_AVAIL_ALLOC))
+		return 0;
+
+	unsigned old = e->addr << 12;
+	if(old != paddr) {
+		page_addref((void *) paddr);
+		e->addr = paddr >> 12;
+		page_free((void *) old);
+	}
+
+	e->readwrite = 0;
+	e->avail |= PAGE_AVAIL_COW;
+
+	if(pagetable_is_loaded(p))
+		asm("invlpg (%0)"::"r"(vaddr):"memory");
+
+	return 1;
+}
+
 void pagetable_copy(struct pagetable *sp, unsigned saddr, struct pagetable *tp, unsigned taddr, unsigned length);
@@ -17,18 +17,43 @@ See the file LICENSE for details.
 #define PAGE_FLAG_READWRITE   4
 #define PAGE_FLAG_NOCLEAR     0
 #define PAGE_FLAG_CLEAR       8
+#define PAGE_FLAG_COW         16
+
+/*
+Given to pagetable_map, PAGE_FLAG_COW maps an existing page read-only
+and copy-on-write.  The caller's reference to the page is handed over
+to the table, which releases it with page_free when unmapped.
+*/
 
 struct pagetable *pagetable_create();
 void pagetable_init(struct pagetable *p);
 int pagetable_map(struct pagetable *p, unsigned vaddr, unsigned paddr, int flags);
 int pagetable_getmap(struct pagetable *p, unsigned vaddr, unsigned *paddr, int *flags);
 void pagetable_unmap(struct pagetable *p, unsigned vaddr);
+int pagetable_map_kernel(unsigned vaddr, unsigned paddr);
+unsigned pagetable_unmap_kernel(unsigned vaddr);
+int pagetable_map_range(struct pagetable *p, unsigned vaddr, unsigned paddr, unsigned length, int flags);
 void pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int flags);
 void pagetable_free(struct pagetable *p, unsigned vaddr, unsigned length);
+void pagetable_reserve(struct pagetable *p, unsigned vaddr, unsigned length, int flags);
+int pagetable_demand_fault(struct pagetable *p, unsigned vaddr);
 void pagetable_delete(struct pagetable *p);
 struct pagetable *pagetable_duplicate(struct pagetable *p);
+int pagetable_cow_fault(struct pagetable *p, unsigned vaddr);
+int pagetable_next_private(struct pagetable *p, unsigned *vaddr, unsigned end, unsigned *paddr);
+int pagetable_clear_dirty(struct pagetable *p, unsigned vaddr);
+int pagetable_clear_accessed(struct pagetable *p, unsigned vaddr);
+int pagetable_compress(struct pagetable *p, unsigned vaddr);
+int pagetable_zram_fault(struct pagetable *p, unsigned vaddr);
+int pagetable_write_protect(struct pagetable *p, unsigned vaddr, unsigned *paddr);
+int pagetable_swap_out(struct pagetable *p, unsigned vaddr, unsigned paddr, unsigned slot);
+int pagetable_swap_entry(struct pagetable *p, unsigned vaddr, unsigned *slot);
+int pagetable_swap_in(struct pagetable *p, unsigned vaddr, unsigned slot, unsigned paddr);
+int pagetable_share(struct pagetable *p, unsigned vaddr, unsigned paddr);
 struct pagetable *pagetable_load(struct pagetable *p);
 void pagetable_enable();
 void pagetable_refresh();
+void pagetable_refresh_global();
+struct pagetable *pagetable_kernel();
 
 #endif
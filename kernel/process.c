@@ -13,18 +13,231 @@ See the file LICENSE for details.
 #include "interrupt.h"
 #include "memorylayout.h"
 #include "kmalloc.h"
+#include "slab.h"
+#include "filemap.h"
+#include "ksm.h"
+#include "zram.h"
+#include "swap.h"
+#include "vmalloc.h"
 #include "kernel/types.h"
 #include "kernelcore.h"
 #include "main.h"
 #include "keyboard.h"
 #include "clock.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "timepage.h"
 
-struct process *current = 0;
-struct list ready_list = { 0, 0 };
 struct list grave_list = { 0, 0 };
 struct list grave_watcher_list = { 0, 0 };	// parent processes are put here to wait for their children
 struct process *process_table[PROCESS_MAX_PID] = { 0 };
 
+/*
+Each process keeps its living children on its children list and
+its dead but unreaped children on its zombies list, linked through
+their sibling nodes, so that killing, waiting for and reaping
+children costs in proportion to the number of children, not the
+number of processes.  A process left without a parent has a ppid
+of zero.  Free pids are tracked in a bitmap, in which pid zero is
+always taken.
+*/
+
+#define PROCESS_PID_WORDS (PROCESS_MAX_PID / 32)
+#define PROCESS_SIBLING(n) ((struct process *) ((char *) (n) - __builtin_offsetof(struct process, sibling)))
+
+static uint32_t pid_bitmap[PROCESS_PID_WORDS] = { 1 };
+
+static void process_ctor(void *p)
+{
+	memset(p, 0, sizeof(struct process));
+}
+
+static struct slab_cache process_cache = SLAB_CACHE_INIT("process", sizeof(struct process), process_ctor);
+
+/*
+The scheduler is a multi-level feedback queue, with one ready list
+for each priority level.  A process starts at its base priority,
+moves down one level each time it uses a whole time slice, and up
+one level each time it blocks and is woken, so that processes that
+mostly wait for I/O stay above those that compute.  Lower levels
+get longer slices, so that compute-bound processes switch less often.
+A process woken by an input device goes straight back to its base
+priority, and every PROCESS_BOOST_MS all processes are returned to
+their base priority, so that nothing waits forever.  The realtime
+level is never demoted, and is round-robin among its members.
+
+Switching only happens on the way back to user mode, where no
+kernel code can have been interrupted, or when a process blocks.
+
+Each processor has its own ready lists.  A process that becomes
+ready goes back to the processor it last ran on, to find its cache
+still warm, unless that one is busy and another is idle.  A processor
+with nothing of its own to run takes work from the others before
+it goes idle.  The boot process is pinned to the boot processor.
+*/
+
+#define PROCESS_BOOST_MS 1000
+
+static void process_boost_all(struct clock_timer *t);
+static struct clock_timer boost_timer = CLOCK_TIMER_INIT(process_boost_all, 0);
+
+static int process_cpu_load(struct cpu *c)
+{
+	int i, n = c->running ? 1 : 0;
+	for(i = 0; i < PROCESS_PRIORITY_LEVELS; i++)
+		n += c->ready[i].size;
+	return n;
+}
+
+static struct cpu *process_choose_cpu(struct process *p)
+{
+	struct cpu *last = p->cpu ? p->cpu : cpu_self();
+	int i;
+
+	if(p->pinned || !last->running)
+		return last;
+
+	struct cpu *best = last;
+	int best_load = process_cpu_load(last);
+
+	for(i = 0; i < cpu_count; i++) {
+		struct cpu *c = &cpu_table[i];
+		if(!c->online || c == last)
+			continue;
+		if(!c->running)
+			return c;
+		int load = process_cpu_load(c);
+		if(load + 1 < best_load) {
+			best = c;
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
+static void process_make_ready(struct process *p)
+{
+	struct cpu *c = process_choose_cpu(p);
+
+	p->state = PROCESS_STATE_READY;
+	p->cpu = c;
+	list_push_tail(&c->ready[p->level], &p->node);
+
+	if(!c->running || p->level < c->running->level) {
+		c->preempt_pending = 1;
+		cpu_reschedule(c);
+	}
+}
+
+static void process_wake(struct process *p)
+{
+	if(p->level > p->priority)
+		p->level--;
+	process_make_ready(p);
+}
+
+/*
+Take the first process from another processor's ready list,
+skipping those that are pinned to it.
+*/
+
+static struct process *process_steal(struct cpu *self, int level)
+{
+	int i;
+	for(i = 0; i < cpu_count; i++) {
+		struct cpu *c = &cpu_table[i];
+		if(c == self)
+			continue;
+		struct process *p = (struct process *) c->ready[level].head;
+		while(p && p->pinned)
+			p = (struct process *) p->node.next;
+		if(p) {
+			list_remove(&p->node);
+			p->cpu = self;
+			return p;
+		}
+	}
+	return 0;
+}
+
+static struct process *process_next_ready(struct cpu *c)
+{
+	int i;
+	for(i = 0; i < PROCESS_PRIORITY_LEVELS; i++) {
+		struct process *p = (struct process *) list_pop_head(&c->ready[i]);
+		if(p)
+			return p;
+	}
+	for(i = 0; i < PROCESS_PRIORITY_LEVELS; i++) {
+		struct process *p = process_steal(c, i);
+		if(p)
+			return p;
+	}
+	return 0;
+}
+
+/*
+Returns true if any process is ready at the given level or above.
+*/
+
+static int process_ready_at(struct cpu *c, int level)
+{
+	int i;
+	for(i = 0; i <= level; i++) {
+		if(c->ready[i].head)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+A process in the RUNNING state other than the current one
+is running on another processor, and must not be disturbed.
+*/
+
+int process_running_elsewhere(struct process *p)
+{
+	return p->state == PROCESS_STATE_RUNNING && p != current;
+}
+
+/*
+The length of a time slice, in multiples of the base slice length.
+*/
+
+unsigned process_slice_scale(struct process *p)
+{
+	if(p->level <= PROCESS_PRIORITY_HIGH)
+		return 1;
+	return 1 << (p->level - PROCESS_PRIORITY_HIGH);
+}
+
+static void process_boost_all(struct clock_timer *t)
+{
+	int i;
+	for(i = 0; i < PROCESS_MAX_PID; i++) {
+		struct process *p = process_table[i];
+		if(!p || p->level == p->priority)
+			continue;
+		p->level = p->priority;
+		if(p->state == PROCESS_STATE_READY) {
+			list_remove(&p->node);
+			process_make_ready(p);
+		}
+	}
+	clock_timer_start(t, t->deadline + PROCESS_BOOST_MS * 1000);
+}
+
+void process_set_priority(struct process *p, int priority)
+{
+	p->priority = priority;
+	p->level = priority;
+	if(p->state == PROCESS_STATE_READY && p != current) {
+		list_remove(&p->node);
+		process_make_ready(p);
+	}
+}
+
 void process_init()
 {
 	current = process_create();
@@ -32,9 +245,13 @@ void process_init()
 	pagetable_load(current->pagetable);
 	pagetable_enable();
 
-	current->state = PROCESS_STATE_READY;
+	current->state = PROCESS_STATE_RUNNING;
+	current->cpu = cpu_self();
+	current->pinned = 1;
 
 	current->waiting_for_child_pid = 0;
+
+	clock_timer_start(&boost_timer, clock_read_us() + PROCESS_BOOST_MS * 1000);
 }
 
 void process_kstack_reset(struct process *p, unsigned entry_point)
@@ -80,7 +297,8 @@ void process_kstack_copy(struct process *parent, struct process *child)
 Valid pids start at 1 and go to PROCESS_MAX_PID.
 To avoid confusion, keep picking increasing
 pids until it is necessary to wrap around.
-"last" is the most recently selected pid.
+The search starts from the word holding the most recently
+selected pid, and looks at a whole word of the bitmap at a time.
 */
 
 static int process_allocate_pid()
@@ -89,23 +307,47 @@ static int process_allocate_pid()
 
 	int i;
 
-	for(i = last + 1; i < PROCESS_MAX_PID; i++) {
-		if(!process_table[i]) {
-			last = i;
-			return i;
-		}
-	}
-
-	for(i = 1; i < last; i++) {
-		if(!process_table[i]) {
-			last = i;
-			return i;
+	for(i = 0; i <= PROCESS_PID_WORDS; i++) {
+		int w = (last / 32 + i) % PROCESS_PID_WORDS;
+		uint32_t free = ~pid_bitmap[w];
+
+		// on the first word, only look above the last pid
+		if(i == 0 && last % 32 != 31)
+			free &= ~0u << (last % 32 + 1);
+		else if(i == 0)
+			free = 0;
+
+		if(free) {
+			int pid = w * 32 + __builtin_ctz(free);
+			pid_bitmap[w] |= 1u << (pid % 32);
+			last = pid;
+			return pid;
 		}
 	}
 
 	return 0;
 }
 
+static void process_free_pid(int pid)
+{
+	if(pid > 0)
+		pid_bitmap[pid / 32] &= ~(1u << (pid % 32));
+}
+
+static struct process *process_parent(struct process *p)
+{
+	return p->ppid ? process_table[p->ppid] : 0;
+}
+
+void process_set_parent(struct process *child, struct process *parent)
+{
+	list_remove(&child->sibling);
+	child->ppid = parent ? parent->pid : 0;
+	if(parent) {
+		list_push_tail(child->state == PROCESS_STATE_GRAVE ? &parent->zombies : &parent->children, &child->sibling);
+	}
+}
+
 void process_selective_inherit(struct process *parent, struct process *child, int * fds, int length)
 {
 	int i;
@@ -118,7 +360,11 @@ void process_selective_inherit(struct process *parent, struct process *child, in
 		}
 	}
 
-	child->ppid = parent->pid;
+	process_set_parent(child, parent);
+
+	/* The realtime class is not inherited by user processes. */
+	child->priority = MAX(parent->priority, PROCESS_PRIORITY_HIGH);
+	child->level = child->priority;
 }
 
 void process_inherit(struct process *parent, struct process *child)
@@ -138,6 +384,13 @@ void process_inherit(struct process *parent, struct process *child)
 	kfree(fds);
 }
 
+/*
+Growing the data or stack segment only reserves the new pages:
+each one is allocated and zeroed by the page fault handler
+the first time it is touched, so untouched memory costs nothing.
+Shrinking releases the pages and so must flush the TLB.
+*/
+
 int process_data_size_set(struct process *p, unsigned size)
 {
 	// XXX check valid ranges
@@ -149,16 +402,15 @@ int process_data_size_set(struct process *p, unsigned size)
 
 	if(size > p->vm_data_size) {
 		uint32_t start = PROCESS_ENTRY_POINT + p->vm_data_size;
-		pagetable_alloc(p->pagetable, start, size, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
+		pagetable_reserve(p->pagetable, start, size - p->vm_data_size, PAGE_FLAG_USER | PAGE_FLAG_READWRITE);
 	} else if(size < p->vm_data_size) {
 		uint32_t start = PROCESS_ENTRY_POINT + size;
-		pagetable_free(p->pagetable, start, p->vm_data_size);
+		pagetable_free(p->pagetable, start, p->vm_data_size - size);
 	} else {
 		// requested size is equal to current.
 	}
 
 	p->vm_data_size = size;
-	pagetable_refresh();
 
 	return 0;
 }
@@ -170,14 +422,13 @@ int process_stack_size_set(struct process *p, unsigned size)
 
 	if(size > p->vm_stack_size) {
 		uint32_t start = -size;
-		pagetable_alloc(p->pagetable, start, size - p->vm_stack_size, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
-	} else {
+		pagetable_reserve(p->pagetable, start, size - p->vm_stack_size, PAGE_FLAG_USER | PAGE_FLAG_READWRITE);
+	} else if(size < p->vm_stack_size) {
 		uint32_t start = -p->vm_stack_size;
 		pagetable_free(p->pagetable, start, p->vm_stack_size - size);
 	}
 
 	p->vm_stack_size = size;
-	pagetable_refresh();
 
 	return 0;
 }
@@ -192,13 +443,21 @@ struct process *process_create()
 {
 	struct process *p;
 
-	p = page_alloc(1);
+	p = slab_alloc(&process_cache);
+	if(!p)
+		return 0;
 
 	p->pid = process_allocate_pid();
 	process_table[p->pid] = p;
 
+	p->ppid = 0;
+	memset(&p->sibling, 0, sizeof(p->sibling));
+	memset(&p->children, 0, sizeof(p->children));
+	memset(&p->zombies, 0, sizeof(p->zombies));
+
 	p->pagetable = pagetable_create();
 	pagetable_init(p->pagetable);
+	timepage_map(p->pagetable);
 
 	p->vm_data_size = 0;
 	p->vm_stack_size = 0;
@@ -219,6 +478,18 @@ struct process *process_create()
 	}
 
 	p->state = PROCESS_STATE_READY;
+	p->priority = PROCESS_PRIORITY_HIGH;
+	p->level = PROCESS_PRIORITY_HIGH;
+	p->cpu = 0;
+	p->pinned = 0;
+	p->killed = 0;
+	p->kthread_func = 0;
+	p->kthread_flags = 0;
+	p->fpu_area = 0;
+	p->fpu_cpu = 0;
+	p->ring = 0;
+	/* A new process first runs from intr_return, which leaves the kernel. */
+	p->lock_depth = 1;
 	memset(p->name, 0, 32);
 
 	return p;
@@ -232,23 +503,114 @@ void process_delete(struct process *p)
 			kobject_close(p->ktable[i]);
 		}
 	}
+	clock_timer_cancel(&p->sleep_timer);
+	fpu_release(p);
+	filemap_delete_all(p);
 	pagetable_delete(p->pagetable);
 	page_free(p->kstack);
-	page_free(p);
+
+	// children outliving their parent are left without one
+	struct list_node *n;
+	while((n = list_pop_head(&p->children)))
+		PROCESS_SIBLING(n)->ppid = 0;
+	while((n = list_pop_head(&p->zombies)))
+		PROCESS_SIBLING(n)->ppid = 0;
+	list_remove(&p->sibling);
+
 	process_table[p->pid] = 0;
+	process_free_pid(p->pid);
+	slab_free(&process_cache, p);
 }
 
 void process_launch(struct process *p)
 {
-	list_push_tail(&ready_list, &p->node);
+	process_make_ready(p);
+}
+
+/*
+Pick the next process for this processor, or wait for one.
+This runs on the processor's own stack, never on that of the
+process that has just switched away, which may already be dead.
+*/
+
+static void process_schedule()
+{
+	struct cpu *c = cpu_self();
+	struct process *p;
+
+	c->running = 0;
+	c->preempt_pending = 0;
+	c->lock_depth = 1;
+
+	while(1) {
+		p = process_next_ready(c);
+		if(p)
+			break;
+
+		if(ksm_idle()) {
+			cpu_kernel_yield();
+			continue;
+		}
+
+		pagetable_load(pagetable_kernel());
+		clock_slice_start();
+		interrupt_wait();
+		interrupt_block();
+	}
+
+	c->running = p;
+	p->state = PROCESS_STATE_RUNNING;
+	p->cpu = c;
+	c->tss.esp0 = (int32_t) p->kstack_top;
+	c->lock_depth = p->lock_depth;
+
+	/*
+	A process that yields and is chosen again keeps the rest of its
+	slice, so that one spinning on process_yield is still demoted.
+	*/
+	if(p != c->yielded)
+		clock_slice_start();
+
+	fpu_switch_in(c, p);
+	process_resume(p->pagetable, p->kstack_ptr);
+}
+
+/*
+Move a dead process onto the grave list and its parent's
+zombies, and wake the parent if it is waiting for it.
+*/
+
+static void process_bury(struct process *p)
+{
+	struct process *parent = process_parent(p);
+
+	p->state = PROCESS_STATE_GRAVE;
+	list_remove(&p->node);
+	list_push_tail(&grave_list, &p->node);
+
+	if(parent) {
+		list_remove(&p->sibling);
+		list_push_tail(&parent->zombies, &p->sibling);
+		if(parent->node.list == &grave_watcher_list && (parent->waiting_for_child_pid == 0 || parent->waiting_for_child_pid == p->pid)) {
+			parent->waiting_for_child_pid = 0;
+			list_remove(&parent->node);
+			process_wake(parent);
+		}
+	}
 }
 
 static void process_switch(int newstate)
 {
+	struct cpu *c;
+
 	interrupt_block();
 
-	if(current) {
-		if(current->state != PROCESS_STATE_CRADLE) {
+	c = cpu_self();
+
+	if(c->running) {
+		struct process *p = c->running;
+
+		if(p->state != PROCESS_STATE_CRADLE) {
 			asm("pushl %ebp");
 			asm("pushl %edi");
 			asm("pushl %esi");
@@ -256,54 +618,78 @@ static void process_switch(int newstate)
 			asm("pushl %ecx");
 			asm("pushl %ebx");
 			asm("pushl %eax");
-		      asm("movl %%esp, %0":"=r"(current->kstack_ptr));
+		      asm("movl %%esp, %0":"=r"(p->kstack_ptr));
 		}
 
-		interrupt_stack_pointer = (void *) INTERRUPT_STACK_TOP;
-		current->state = newstate;
+		fpu_switch_out(p);
+
+		p->lock_depth = c->lock_depth;
+		p->state = newstate;
+		c->yielded = newstate == PROCESS_STATE_READY ? p : 0;
 
 		if(newstate == PROCESS_STATE_READY) {
-			list_push_tail(&ready_list, &current->node);
+			list_push_tail(&c->ready[p->level], &p->node);
 		}
 		if(newstate == PROCESS_STATE_GRAVE) {
-			list_push_tail(&grave_list, &current->node);
+			process_bury(p);
 		}
 	}
 
-	current = 0;
+	asm volatile("movl %0, %%esp; call *%1"::"r"(c->stack_top), "r"(process_schedule));
+}
 
-	while(1) {
-		current = (struct process *) list_pop_head(&ready_list);
-		if(current)
-			break;
+/*
+Called by each processor other than the first once it has started,
+on its own stack and holding the kernel lock, to begin running processes.
+*/
 
-		interrupt_unblock();
-		interrupt_wait();
-		interrupt_block();
-	}
+void process_start_cpu()
+{
+	process_schedule();
+}
 
-	current->state = PROCESS_STATE_RUNNING;
-	interrupt_stack_pointer = current->kstack_top;
+/*
+Called by the clock when the running process has used its whole
+time slice: move it down a level, and let the next process at the
+same level or above have a turn once it is safe to switch.
+*/
 
-	asm("movl %0, %%cr3"::"r"(current->pagetable));
-	asm("movl %0, %%esp"::"r"(current->kstack_ptr));
+void process_slice_expired()
+{
+	if(!current)
+		return;
 
-	asm("popl %eax");
-	asm("popl %ebx");
-	asm("popl %ecx");
-	asm("popl %edx");
-	asm("popl %esi");
-	asm("popl %edi");
-	asm("popl %ebp");
+	current->stats.slices_used++;
+	if(current->level > PROCESS_PRIORITY_REALTIME && current->level < PROCESS_PRIORITY_LOW)
+		current->level++;
 
-	interrupt_unblock();
+	cpu_self()->preempt_pending = 1;
+	clock_slice_start();
 }
 
-int allow_preempt = 0;
+/*
+Called from kernelcore on the way back to user mode from an
+interrupt or system call, when nothing in the kernel can be
+in the middle of an operation, to carry out any pending switch.
+A process killed while running on this processor dies here.
+*/
 
-void process_preempt()
+void process_return_user()
 {
-	if(allow_preempt && current && ready_list.head) {
+	struct cpu *c = cpu_self();
+
+	if(!current)
+		return;
+
+	if(current->killed)
+		process_switch(PROCESS_STATE_GRAVE);
+
+	if(!c->preempt_pending)
+		return;
+
+	c->preempt_pending = 0;
+	if(process_ready_at(c, current->level)) {
+		current->stats.preemptions++;
 		process_switch(PROCESS_STATE_READY);
 	}
 }
@@ -320,8 +706,7 @@ void process_exit(int code)
 	// printf("process %d exiting with status %d...\n", current->pid, code); --> transport to kshell run
 	current->exitcode = code;
 	current->exitreason = PROCESS_EXIT_NORMAL;
-	process_wakeup_parent(&grave_watcher_list);	// On exit, wake up parent if need be
-	process_switch(PROCESS_STATE_GRAVE);
+	process_switch(PROCESS_STATE_GRAVE);	// waking the parent if need be
 }
 
 void process_wait(struct list *q)
@@ -335,33 +720,31 @@ void process_wakeup(struct list *q)
 	struct process *p;
 	p = (struct process *) list_pop_head(q);
 	if(p) {
-		p->state = PROCESS_STATE_READY;
-		list_push_tail(&ready_list, &p->node);
+		process_wake(p);
 	}
 }
 
-void process_reap_all()
+/*
+Wake a process waiting for keyboard or mouse input, restoring it
+to its base priority at once, so that whoever is waiting on the user
+runs ahead of any compute-bound work.
+*/
+
+void process_wakeup_input(struct list *q)
 {
 	struct process *p;
-	while((p = (struct process *) list_pop_head(&grave_list))) {
-		process_delete(p);
+	p = (struct process *) list_pop_head(q);
+	if(p) {
+		p->level = p->priority;
+		process_make_ready(p);
 	}
 }
 
-/* Wakes up parent off of the corresponding list*/
-void process_wakeup_parent(struct list *q)
+void process_reap_all()
 {
-	struct process *p = (struct process *) q->head;
-	// Loop through all the waiting parents to see if one needs to be woken up
-	while(p) {
-		if(p->pid == current->ppid && (p->waiting_for_child_pid == 0 || p->waiting_for_child_pid == current->pid)) {
-			p->state = PROCESS_STATE_READY;
-			p->waiting_for_child_pid = 0;
-			list_remove(&p->node);
-			list_push_tail(&ready_list, &p->node);
-			break;
-		}
-		p = (struct process *) (&p->node)->next;
+	struct process *p;
+	while((p = (struct process *) list_pop_head(&grave_list))) {
+		process_delete(p);
 	}
 }
 
@@ -369,11 +752,23 @@ void process_wakeup_all(struct list *q)
 {
 	struct process *p;
 	while((p = (struct process *) list_pop_head(q))) {
-		p->state = PROCESS_STATE_READY;
-		list_push_tail(&ready_list, &p->node);
+		process_wake(p);
 	}
 }
 
+/*
+Wake a single process blocked on some queue, such as a sleeper
+whose timer has expired, without disturbing the rest of the queue.
+*/
+
+void process_wakeup_one(struct process *p)
+{
+	if(p->state != PROCESS_STATE_BLOCKED)
+		return;
+	list_remove(&p->node);
+	process_wake(p);
+}
+
 void process_dump(struct process *p)
 {
 	struct x86_stack *s = (struct x86_stack *) (INTERRUPT_STACK_TOP - sizeof(*s));
@@ -414,29 +809,44 @@ int process_object_max(struct process *p)
 	return -1;
 }
 
+/*
+A process already in its grave has been buried, and keeps the
+exit code it was given then.
+*/
+
 void process_make_dead(struct process *dead)
 {
-	int i;
-	for(i = 0; i < PROCESS_MAX_PID; i++) {
-		if(process_table[i] && process_table[i]->ppid == dead->pid) {
-			process_make_dead(process_table[i]);
-		}
+	struct list_node *n, *next;
+	if(dead->state == PROCESS_STATE_GRAVE)
+		return;
+	for(n = dead->children.head; n; n = next) {
+		next = n->next;
+		if(!PROCESS_SIBLING(n)->kthread_func)
+			process_make_dead(PROCESS_SIBLING(n));
 	}
 	dead->exitcode = 0;
 	dead->exitreason = PROCESS_EXIT_KILLED;
+	clock_timer_cancel(&dead->sleep_timer);
 	if(dead == current) {
 		process_switch(PROCESS_STATE_GRAVE);
+	} else if(process_running_elsewhere(dead)) {
+		dead->killed = 1;
+		cpu_reschedule(dead->cpu);
 	} else {
-		list_remove(&dead->node);
-		list_push_tail(&grave_list, &dead->node);
+		process_bury(dead);
 	}
 }
 
+/*
+Kernel threads are not killed or reaped by pid: their owners keep
+pointers to them, and stop them with kthread_stop.
+*/
+
 int process_kill(uint32_t pid)
 {
-	if(pid > 0 && pid <= PROCESS_MAX_PID) {
+	if(pid > 0 && pid < PROCESS_MAX_PID) {
 		struct process *dead = process_table[pid];
-		if(dead) {
+		if(dead && !dead->kthread_func) {
 			printf("process killed\n");
 			process_make_dead(dead);
 			return 0;
@@ -459,16 +869,16 @@ int process_wait_child(uint32_t pid, struct process_info *info, int timeout)
 	start = clock_read();
 
 	do {
-		struct process *p = (struct process *) (grave_list.head);
-		while(p) {
-			struct process *next = (struct process *) p->node.next;
-			if((pid != 0 && p->pid == pid) || (p->ppid == current->pid)) {
-				info->exitcode = p->exitcode;
-				info->exitreason = p->exitreason;
-				info->pid = p->pid;
-				return p->pid;
-			}
-			p = next;
+		struct process *p = 0;
+		if(pid > 0 && pid < PROCESS_MAX_PID)
+			p = process_table[pid];
+		if(!p || p->state != PROCESS_STATE_GRAVE)
+			p = current->zombies.head ? PROCESS_SIBLING(current->zombies.head) : 0;
+		if(p) {
+			info->exitcode = p->exitcode;
+			info->exitreason = p->exitreason;
+			info->pid = p->pid;
+			return p->pid;
 		}
 
 		current->waiting_for_child_pid = pid;
@@ -483,15 +893,11 @@ int process_wait_child(uint32_t pid, struct process_info *info, int timeout)
 
 int process_reap(uint32_t pid)
 {
-	struct process *p = (struct process *) (grave_list.head);
-	while(p) {
-		struct process *next = (struct process *) p->node.next;
-		if(p->pid == pid) {
-			list_remove(&p->node);
-			process_delete(p);
-			return 0;
-		}
-		p = next;
+	struct process *p = pid < PROCESS_MAX_PID ? process_table[pid] : 0;
+	if(p && p->state == PROCESS_STATE_GRAVE && !p->kthread_func) {
+		list_remove(&p->node);
+		process_delete(p);
+		return 0;
 	}
 	return 1;
 }
@@ -561,6 +967,45 @@ int process_stats(int pid, struct process_stats *s)
 	return 0;
 }
 
+/*
+Advance the sweep until evict has released npages pages, or max pages
+have been looked at.  As with a clock, a page accessed since the last
+time around has its accessed bit cleared and is passed over, and evict
+is only offered pages that have not been touched in a whole turn.
+The sweep is left pointing after the last page visited.  The calling
+process is skipped, since its own table may be half way through a
+change when an allocation sends it here.
+*/
+
+#define PROCESS_SWEEP_END (PROCESS_STACK_INIT & PAGE_MASK)
+
+unsigned process_sweep(struct process_sweep *s, unsigned npages, unsigned max, process_evict_t evict)
+{
+	unsigned count = 0;
+	unsigned scanned = 0;
+
+	while(count < npages && scanned < max) {
+		struct process *p = process_table[s->pid];
+		unsigned vaddr = s->vaddr;
+		unsigned paddr;
+
+		if(p && p != current && p->state != PROCESS_STATE_GRAVE && !process_running_elsewhere(p) && pagetable_next_private(p->pagetable, &vaddr, PROCESS_SWEEP_END, &paddr)) {
+			s->vaddr = vaddr + PAGE_SIZE;
+			scanned++;
+			if(!pagetable_clear_accessed(p->pagetable, vaddr) && evict(p, vaddr))
+				count++;
+		} else {
+			s->pid = (s->pid + 1) % PROCESS_MAX_PID;
+			s->vaddr = PROCESS_ENTRY_POINT;
+			// an empty turn around the process table counts for part of the budget
+			if(s->pid == 0)
+				scanned += max / 4 + 1;
+		}
+	}
+
+	return count;
+}
+
 void process_list()
 {
 	int i;
@@ -592,7 +1037,8 @@ void process_list()
 	int seconds = up_seconds % 60;
 
 	uint32_t nfree, ntotal;
-	page_stats(&nfree, &ntotal);
+	uint32_t nblocks[PAGE_ORDER_MAX + 1];
+	page_stats(&nfree, &ntotal, nblocks);
 	uint32_t total_mem_kb = ntotal * (PAGE_SIZE / 1024);
 	uint32_t free_mem_kb = nfree * (PAGE_SIZE / 1024);
 	uint32_t used_mem_kb = total_mem_kb - free_mem_kb;
@@ -601,9 +1047,31 @@ void process_list()
 	printf("Tasks: %d total, %d running, %d ready, %d sleeping, %d zombie\n", 
 		   total_procs, running, ready, sleeping, zombie);
 	printf("Mem: %d KB total, %d KB used, %d KB free\n", total_mem_kb, used_mem_kb, free_mem_kb);
+
+	unsigned ksm_shared, ksm_saved;
+	ksm_stats(&ksm_shared, &ksm_saved);
+	printf("Merged: %d pages shared, %d KB saved\n", ksm_shared, ksm_saved * (PAGE_SIZE / 1024));
+
+	uint32_t zram_pages, zram_bytes, zram_faults;
+	zram_stats(&zram_pages, &zram_bytes, &zram_faults);
+	printf("Compressed: %d pages in %d KB, %d faults\n", zram_pages, zram_bytes / 1024, zram_faults);
+
+	uint32_t swap_used, swap_total;
+	swap_stats(&swap_used, &swap_total);
+	printf("Swap: %d KB total, %d KB used\n", swap_total * (PAGE_SIZE / 1024), swap_used * (PAGE_SIZE / 1024));
+
+	unsigned vmalloc_areas, vmalloc_pages;
+	vmalloc_stats(&vmalloc_areas, &vmalloc_pages);
+	printf("Vmalloc: %d areas, %d KB\n", vmalloc_areas, vmalloc_pages * (PAGE_SIZE / 1024));
+	printf("Processors: %d online\n", cpu_online());
+	printf("Free blocks by order:");
+	for(i = 0; i <= PAGE_ORDER_MAX; i++) {
+		printf(" %d", nblocks[i]);
+	}
+	printf("\n");
 	printf("\n");
 
-	printf("PID   PPID  STATE    MEM(KB)  NAME\n");
+	printf("PID   PPID  STATE    PRI  MEM(KB)  NAME\n");
 	for(i = 0; i < PROCESS_MAX_PID; i++) {
 		if(process_table[i]) {
 			struct process *p = process_table[i];
@@ -629,7 +1097,7 @@ void process_list()
 				break;
 			}
 			uint32_t mem_kb = (p->vm_data_size + p->vm_stack_size) / 1024;
-			printf("%d     %d     %s  %d       %s\n", p->pid, p->ppid, state, mem_kb, p->name);
+			printf("%d     %d     %s  %d/%d  %d       %s\n", p->pid, p->ppid, state, p->level, p->priority, mem_kb, p->name);
 		}
 	}
 }
@@ -9,11 +9,15 @@ See the file LICENSE for details.
 
 #include "kernel/types.h"
 #include "kernel/stats.h"
+#include "kernel/ring.h"
 #include "list.h"
 #include "pagetable.h"
 #include "kobject.h"
 #include "x86.h"
 #include "fs.h"
+#include "memorylayout.h"
+#include "clock.h"
+#include "cpu.h"
 
 #define PROCESS_STATE_CRADLE  0
 #define PROCESS_STATE_READY   1
@@ -29,6 +33,9 @@ See the file LICENSE for details.
 
 struct process {
 	struct list_node node;
+	struct list_node sibling;
+	struct list children;
+	struct list zombies;
 	int state;
 	int exitcode;
 	int exitreason;
@@ -42,17 +49,48 @@ struct process {
 	uint32_t ppid;
 	uint32_t vm_data_size;
 	uint32_t vm_stack_size;
+	struct list filemap_list;
 	uint32_t waiting_for_child_pid;
+	struct clock_timer sleep_timer;
+	int priority;
+	int level;
+	struct cpu *cpu;
+	int pinned;
+	int lock_depth;
+	int killed;
+	void (*kthread_func) (void *arg);
+	void *kthread_arg;
+	int kthread_flags;
+	char *fpu_area;
+	struct cpu *fpu_cpu;
+	struct ring *ring;
 	char name[32];
 };
 
+/*
+A sweep visits the private pages of all user processes in turn,
+picking up where it last left off, to choose pages to give up under
+memory pressure.  Each module that evicts pages keeps its own sweep.
+*/
+
+struct process_sweep {
+	int pid;
+	unsigned vaddr;
+};
+
+#define PROCESS_SWEEP_INIT {0,PROCESS_ENTRY_POINT}
+
+typedef int (*process_evict_t) (struct process *p, unsigned vaddr);
+
 void process_init();
+void process_start_cpu();
 
 struct process *process_create();
 void process_delete(struct process *p);
 void process_launch(struct process *p);
 void process_pass_arguments(struct process *p, int argc, char **argv);
 void process_inherit(struct process *parent, struct process *child);
+void process_set_parent(struct process *child, struct process *parent);
 void process_selective_inherit(struct process *parent, struct process *child, int * fds, int fd_len);
 
 void process_stack_reset(struct process *p, unsigned size);
@@ -66,24 +104,31 @@ int process_available_fd(struct process *p);
 int process_object_max(struct process *p);
 
 void process_yield();
-void process_preempt();
+void process_slice_expired();
+void process_return_user();
+void process_set_priority(struct process *p, int priority);
+unsigned process_slice_scale(struct process *p);
 void process_exit(int code);
 void process_dump(struct process *p);
 
 void process_wait(struct list *q);
 void process_wakeup(struct list *q);
-void process_wakeup_parent(struct list *q);
 void process_wakeup_all(struct list *q);
+void process_wakeup_input(struct list *q);
+void process_wakeup_one(struct process *p);
 void process_reap_all();
 
 int process_kill(uint32_t pid);
 int process_wait_child(uint32_t pid, struct process_info *info, int timeout);
 int process_reap(uint32_t pid);
 
+int process_running_elsewhere(struct process *p);
 int process_stats(int pid, struct process_stats *stat);
+unsigned process_sweep(struct process_sweep *s, unsigned npages, unsigned max, process_evict_t evict);
 void process_list();
 
-extern struct process *current;
+#define current (cpu_self()->running)
+
 extern struct process *process_table[PROCESS_MAX_PID];
 
 #endif
@@ -15,6 +15,7 @@ Recommended reading: page 11-15 of the RTC data sheet
 #include "console.h"
 #include "string.h"
 #include "interrupt.h"
+#include "timepage.h"
 
 #define RTC_BASE 0x80
 
@@ -137,6 +138,7 @@ static void rtc_fetch_time()
 	}
 
 	cached_time = t;
+	timepage_set_rtc(&t);
 }
 
 static void rtc_interrupt_handler(int intr, int code)
@@ -0,0 +1,182 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "slab.h"
+#include "page.h"
+#include "string.h"
+#include "console.h"
+
+/*
+Each slab is a naturally aligned block from page_alloc_order(),
+beginning with a struct slab header followed by the objects.
+Because buddy blocks are aligned on their own size, the slab
+owning an object is found by masking the object address.
+Free objects are threaded into a list through their first word,
+and a bitmap records which objects are in use, so that double
+frees, frees to the wrong cache, and pointers into the middle
+of an object are caught.
+A slab is always on exactly one of the partial, full or empty
+lists of its cache, and at most one empty slab is kept around.
+*/
+
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_MAX_OBJECTS 512
+#define SLAB_BITMAP_WORDS (SLAB_MAX_OBJECTS/32)
+
+struct slab {
+	struct list_node node;
+	struct slab_cache *cache;
+	unsigned inuse;
+	void *freelist;
+	uint32_t bitmap[SLAB_BITMAP_WORDS];
+};
+
+static struct slab_cache *cache_list = 0;
+
+static void slab_cache_setup(struct slab_cache *c)
+{
+	// round up to pointer size so the free list can be threaded through objects
+	if(c->size < sizeof(void *))
+		c->size = sizeof(void *);
+	if(c->size % sizeof(void *))
+		c->size += sizeof(void *) - c->size % sizeof(void *);
+
+	c->order = 0;
+	while(c->order < PAGE_ORDER_MAX && ((PAGE_SIZE << c->order) - sizeof(struct slab)) / c->size < SLAB_MIN_OBJECTS)
+		c->order++;
+
+	c->objects_per_slab = ((PAGE_SIZE << c->order) - sizeof(struct slab)) / c->size;
+	if(c->objects_per_slab > SLAB_MAX_OBJECTS)
+		c->objects_per_slab = SLAB_MAX_OBJECTS;
+
+	c->next = cache_list;
+	cache_list = c;
+}
+
+static struct slab *slab_create(struct slab_cache *c)
+{
+	unsigned i;
+
+	struct slab *s = page_alloc_order(c->order, 0);
+	if(!s)
+		return 0;
+
+	s->cache = c;
+	s->inuse = 0;
+	s->freelist = 0;
+	memset(s->bitmap, 0, sizeof(s->bitmap));
+
+	// thread the free list in reverse so objects are handed out in address order
+	char *objects = (char *) (s + 1);
+	for(i = c->objects_per_slab; i > 0; i--) {
+		void **o = (void **) (objects + (i - 1) * c->size);
+		*o = s->freelist;
+		s->freelist = o;
+	}
+
+	c->nslabs++;
+	return s;
+}
+
+static struct slab *slab_of(struct slab_cache *c, void *object)
+{
+	return (struct slab *) ((uint32_t) object & ~((PAGE_SIZE << c->order) - 1));
+}
+
+void *slab_alloc(struct slab_cache *c)
+{
+	struct slab *s;
+
+	if(c->order < 0)
+		slab_cache_setup(c);
+
+	s = (struct slab *) c->partial.head;
+	if(!s) {
+		s = (struct slab *) list_pop_head(&c->empty);
+		if(!s) {
+			s = slab_create(c);
+			if(!s) {
+				printf("slab: %s: out of memory!\n", c->name);
+				return 0;
+			}
+		}
+		list_push_head(&c->partial, &s->node);
+	}
+
+	void **o = s->freelist;
+	s->freelist = *o;
+	s->inuse++;
+
+	unsigned index = ((char *) o - (char *) (s + 1)) / c->size;
+	s->bitmap[index / 32] |= (1 << (index % 32));
+
+	if(s->inuse == c->objects_per_slab) {
+		list_remove(&s->node);
+		list_push_head(&c->full, &s->node);
+	}
+
+	c->nobjects++;
+
+	if(c->ctor)
+		c->ctor(o);
+
+	return o;
+}
+
+void slab_free(struct slab_cache *c, void *object)
+{
+	if(!object)
+		return;
+
+	struct slab *s = slab_of(c, object);
+	unsigned offset = (char *) object - (char *) (s + 1);
+	unsigned index = offset / c->size;
+
+	if(offset % c->size) {
+		printf("slab: %s: misaligned slab_free(%x)\n", c->name, object);
+		return;
+	}
+
+	if(s->cache != c || index >= c->objects_per_slab || !(s->bitmap[index / 32] & (1 << (index % 32)))) {
+		printf("slab: %s: invalid slab_free(%x)\n", c->name, object);
+		return;
+	}
+
+	s->bitmap[index / 32] &= ~(1 << (index % 32));
+
+	void **o = object;
+	*o = s->freelist;
+	s->freelist = o;
+
+	if(s->inuse == c->objects_per_slab) {
+		list_remove(&s->node);
+		list_push_head(&c->partial, &s->node);
+	}
+
+	s->inuse--;
+	c->nobjects--;
+
+	if(s->inuse == 0) {
+		list_remove(&s->node);
+		if(c->empty.head) {
+			page_free(s);
+			c->nslabs--;
+		} else {
+			list_push_head(&c->empty, &s->node);
+		}
+	}
+}
+
+void slab_debug()
+{
+	struct slab_cache *c;
+
+	printf("cache        size order slabs objects\n");
+
+	for(c = cache_list; c; c = c->next) {
+		printf("%s %d %d %d %d/%d\n", c->name, c->size, c->order, c->nslabs, c->nobjects, c->nslabs * c->objects_per_slab);
+	}
+}
@@ -0,0 +1,43 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "kernel/types.h"
+#include "list.h"
+
+/*
+A slab cache hands out fixed-size objects of a single type.
+Caches are declared statically with SLAB_CACHE_INIT and set
+themselves up on first use, so they may be used before or
+without any explicit initialization step.  If a constructor
+is given, it is applied to each object as it is allocated.
+*/
+
+typedef void (*slab_ctor_t) (void *object);
+
+struct slab_cache {
+	const char *name;
+	unsigned size;
+	slab_ctor_t ctor;
+	int order;
+	unsigned objects_per_slab;
+	struct list partial;
+	struct list full;
+	struct list empty;
+	unsigned nslabs;
+	unsigned nobjects;
+	struct slab_cache *next;
+};
+
+#define SLAB_CACHE_INIT(name,size,ctor) {name,size,ctor,-1,0,LIST_INIT,LIST_INIT,LIST_INIT,0,0,0}
+
+void *slab_alloc(struct slab_cache *c);
+void  slab_free(struct slab_cache *c, void *object);
+void  slab_debug();
+
+#endif
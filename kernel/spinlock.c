@@ -0,0 +1,54 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "spinlock.h"
+
+void spinlock_acquire(struct spinlock *l)
+{
+	uint16_t ticket = 1;
+
+	asm volatile("lock xaddw %0, %1":"+r"(ticket), "+m"(l->next)::"memory");
+
+	while(l->owner != ticket) {
+		asm volatile("pause":::"memory");
+	}
+}
+
+void spinlock_release(struct spinlock *l)
+{
+	asm volatile("":::"memory");
+	l->owner++;
+}
+
+/*
+Returns true if some processor is waiting behind the holder.
+*/
+
+int spinlock_contended(struct spinlock *l)
+{
+	return (uint16_t) (l->next - l->owner) > 1;
+}
+
+/*
+Take a lock that may also be taken by an interrupt handler, blocking
+interrupts on this processor first.  Returns the previous interrupt
+state, for spinlock_release_restore to put back.
+*/
+
+uint32_t spinlock_acquire_block(struct spinlock *l)
+{
+	uint32_t flags;
+	asm volatile("pushfl; popl %0; cli":"=r"(flags)::"memory");
+	spinlock_acquire(l);
+	return flags;
+}
+
+void spinlock_release_restore(struct spinlock *l, uint32_t flags)
+{
+	spinlock_release(l);
+	if(flags & 0x200)
+		asm volatile("sti":::"memory");
+}
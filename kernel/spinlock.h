@@ -0,0 +1,34 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "kernel/types.h"
+
+/*
+A spinlock is a ticket lock: each processor takes the next ticket
+and waits for its number to come up, so that processors are served
+in the order they arrived and none can be starved.  A spinlock does
+not change the interrupt state: a lock that is also taken by an
+interrupt handler must only be taken with interrupts blocked.
+*/
+
+struct spinlock {
+	volatile uint16_t owner;
+	volatile uint16_t next;
+};
+
+#define SPINLOCK_INIT {0,0}
+
+void spinlock_acquire(struct spinlock *l);
+void spinlock_release(struct spinlock *l);
+int  spinlock_contended(struct spinlock *l);
+
+uint32_t spinlock_acquire_block(struct spinlock *l);
+void     spinlock_release_restore(struct spinlock *l, uint32_t flags);
+
+#endif
@@ -0,0 +1,218 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "swap.h"
+#include "process.h"
+#include "pagetable.h"
+#include "page.h"
+#include "vmalloc.h"
+#include "string.h"
+#include "console.h"
+#include "kernel/error.h"
+
+/*
+Each slot of the swap area holds one page, and has a reference
+count, since a page table duplicated by fork shares the slots of
+its parent just as it shares pages.  Free slots are found by
+scanning forward from the slot after the last one allocated.
+Slot numbers must fit in the address field of a page entry.
+*/
+
+#define SWAP_SLOTS_MAX (1 << 20)
+#define SWAP_SCAN_MAX 1024
+
+static struct device *swap_device = 0;
+static uint32_t swap_first_block = 0;
+static uint32_t blocks_per_page = 0;
+
+static uint16_t *slot_refs = 0;
+static uint32_t slots_total = 0;
+static uint32_t slots_used = 0;
+static uint32_t next_slot = 0;
+
+static struct process_sweep sweep = PROCESS_SWEEP_INIT;
+
+static int swap_slot_alloc(uint32_t *slot)
+{
+	uint32_t i;
+
+	for(i = 0; i < slots_total; i++) {
+		uint32_t s = (next_slot + i) % slots_total;
+		if(!slot_refs[s]) {
+			slot_refs[s] = 1;
+			slots_used++;
+			next_slot = s + 1;
+			*slot = s;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int swap_slot_valid(uint32_t slot, const char *op)
+{
+	if(slot >= slots_total || !slot_refs[slot]) {
+		printf("swap: invalid %s(%d)\n", op, slot);
+		return 0;
+	}
+	return 1;
+}
+
+void swap_addref(uint32_t slot)
+{
+	if(swap_slot_valid(slot, "swap_addref"))
+		slot_refs[slot]++;
+}
+
+void swap_free(uint32_t slot)
+{
+	if(!swap_slot_valid(slot, "swap_free"))
+		return;
+
+	slot_refs[slot]--;
+	if(!slot_refs[slot])
+		slots_used--;
+}
+
+static int swap_write(uint32_t slot, const void *page)
+{
+	return device_write(swap_device, page, blocks_per_page, swap_first_block + slot * blocks_per_page) == blocks_per_page;
+}
+
+static int swap_read(uint32_t slot, void *page)
+{
+	return device_read(swap_device, page, blocks_per_page, swap_first_block + slot * blocks_per_page) == blocks_per_page;
+}
+
+/*
+The device may block the calling process, and kernel code may be
+preempted, so the page is not unmapped until it has been written.
+It is first made read-only and copy-on-write, and an extra reference
+keeps it alive while the write is in progress.  If the process writes
+to the page meanwhile, it simply becomes writable again, and
+pagetable_swap_out sees that the entry has changed and declines.
+The process itself may have exited before the write completes.
+*/
+
+static int swap_evict(struct process *p, unsigned vaddr)
+{
+	int pid = p->pid;
+	unsigned paddr;
+	uint32_t slot;
+
+	if(!pagetable_write_protect(p->pagetable, vaddr, &paddr))
+		return 0;
+
+	if(!swap_slot_alloc(&slot))
+		return 0;
+
+	page_addref((void *) paddr);
+
+	int result = swap_write(slot, (void *) paddr) && process_table[pid] == p && pagetable_swap_out(p->pagetable, vaddr, paddr, slot);
+
+	if(result)
+		p->stats.swap_pages_out++;
+	else
+		swap_free(slot);
+
+	page_free((void *) paddr);
+
+	return result;
+}
+
+/*
+Called by the page allocator under memory pressure, after the
+compressed store has had its turn.  Writing to the device blocks,
+so swapping is left to background reclaim, and nothing is done
+in the middle of an allocation.
+*/
+
+static unsigned swap_shrink(unsigned npages, int can_block)
+{
+	if(!can_block || !swap_device)
+		return 0;
+
+	return process_sweep(&sweep, npages, SWAP_SCAN_MAX, swap_evict);
+}
+
+static struct page_shrinker swap_shrinker = PAGE_SHRINKER_INIT("swap", swap_shrink);
+
+/*
+Read a swapped out page back in on a fault.  The entry is checked
+again once the read completes, since the process blocks meanwhile.
+Returns 1 if the address was swapped out and the fault is resolved.
+*/
+
+int swap_fault(struct process *p, uint32_t vaddr)
+{
+	uint32_t slot;
+
+	if(!pagetable_swap_entry(p->pagetable, vaddr, &slot))
+		return 0;
+
+	void *page = page_alloc(0);
+	if(!page)
+		return 0;
+
+	if(!swap_read(slot, page)) {
+		printf("swap: couldn't read slot %d\n", slot);
+		page_free(page);
+		return 0;
+	}
+
+	if(!pagetable_swap_in(p->pagetable, vaddr, slot, (unsigned) page))
+		page_free(page);
+
+	p->stats.swap_faults++;
+
+	return 1;
+}
+
+/*
+Use nblocks blocks of the device, starting at first_block, as the
+swap area.  If nblocks is zero, the area extends to the end of the device.
+*/
+
+int swap_enable(struct device *d, uint32_t first_block, uint32_t nblocks)
+{
+	if(swap_device)
+		return KERROR_INVALID_REQUEST;
+
+	int block_size = device_block_size(d);
+	if(block_size <= 0 || PAGE_SIZE % block_size)
+		return KERROR_INVALID_REQUEST;
+
+	uint32_t device_blocks = device_nblocks(d);
+	if(first_block >= device_blocks)
+		return KERROR_INVALID_REQUEST;
+	if(nblocks == 0 || nblocks > device_blocks - first_block)
+		nblocks = device_blocks - first_block;
+
+	uint32_t nslots = MIN(nblocks / (PAGE_SIZE / block_size), SWAP_SLOTS_MAX);
+	if(nslots == 0)
+		return KERROR_OUT_OF_SPACE;
+
+	slot_refs = vmalloc(nslots * sizeof(*slot_refs));
+	if(!slot_refs)
+		return KERROR_OUT_OF_MEMORY;
+	memset(slot_refs, 0, nslots * sizeof(*slot_refs));
+
+	swap_device = device_addref(d);
+	swap_first_block = first_block;
+	blocks_per_page = PAGE_SIZE / block_size;
+	slots_total = nslots;
+
+	page_shrinker_register(&swap_shrinker);
+
+	return nslots;
+}
+
+void swap_stats(uint32_t *nused, uint32_t *ntotal)
+{
+	*nused = slots_used;
+	*ntotal = slots_total;
+}
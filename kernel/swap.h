@@ -0,0 +1,29 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef SWAP_H
+#define SWAP_H
+
+#include "device.h"
+#include "kernel/types.h"
+
+struct process;
+
+/*
+Once a swap area is enabled on a range of blocks of a device,
+user pages that have not been touched for a while are written out
+to a slot of the swap area and released, and the page table keeps
+the slot number in place of the page address.  A fault on the page
+reads it back from the slot into a newly allocated page.
+*/
+
+int  swap_enable(struct device *d, uint32_t first_block, uint32_t nblocks);
+int  swap_fault(struct process *p, uint32_t vaddr);
+void swap_addref(uint32_t slot);
+void swap_free(uint32_t slot);
+void swap_stats(uint32_t *nused, uint32_t *ntotal);
+
+#endif
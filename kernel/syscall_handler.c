@@ -28,6 +28,12 @@ See the file LICENSE for details.
 #include "window.h"
 #include "is_valid.h"
 #include "bcache.h"
+#include "slab.h"
+#include "filemap.h"
+#include "ksm.h"
+#include "zram.h"
+#include "swap.h"
+#include "fpu.h"
 
 /*
 syscall_handler() is responsible for decoding system calls
@@ -69,13 +75,25 @@ int sys_process_exit(int status)
 	return 0;
 }
 
-/* Helper routines to duplicate/free an argv array locally */
+/*
+Helper routines to duplicate/free an argv array locally.
+Ordinary argument lists fit in a fixed-size object from
+argv_cache, and only unusually long ones fall back to kmalloc.
+*/
+
+#define ARGV_CACHE_MAX 32
+
+static struct slab_cache argv_cache = SLAB_CACHE_INIT("argv", sizeof(char *) * ARGV_CACHE_MAX, 0);
 
 static char **argv_copy(int argc, const char **argv)
 {
 	char **pp;
 
-	pp = kmalloc(sizeof(char *) * argc);
+	if(argc <= ARGV_CACHE_MAX) {
+		pp = slab_alloc(&argv_cache);
+	} else {
+		pp = kmalloc(sizeof(char *) * argc);
+	}
 	int i;
 	for(i = 0; i < argc; i++) {
 		pp[i] = strdup(argv[i]);
@@ -90,7 +108,11 @@ static void argv_delete(int argc, char **argv)
 	for(i = 0; i < argc; i++) {
 		kfree(argv[i]);
 	}
-	kfree(argv);
+	if(argc <= ARGV_CACHE_MAX) {
+		slab_free(&argv_cache, argv);
+	} else {
+		kfree(argv);
+	}
 }
 
 /*
@@ -226,9 +248,14 @@ int sys_process_exec( int fd, int argc, const char **argv)
 		return r;
 	}
 
+	/* The old program's file maps do not survive into the new one. */
+	filemap_delete_all(current);
+
 	/* Reset the stack and pass in the program arguments */
 	process_stack_reset(current, PAGE_SIZE);
 	process_kstack_reset(current, entry);
+	fpu_release(current);
+	current->ring = 0;
 	process_pass_arguments(current, argc, copy_argv);
 	if (argc > 0) {
 		strncpy(current->name, copy_argv[0], 31);
@@ -254,9 +281,14 @@ int sys_process_exec( int fd, int argc, const char **argv)
 int sys_process_fork()
 {
 	struct process *p = process_create();
-	p->ppid = current->pid;
+	process_set_parent(p, current);
 	pagetable_delete(p->pagetable);
 	p->pagetable = pagetable_duplicate(current->pagetable);
+	/* The parent's writable pages are now read-only, so drop stale TLB entries. */
+	pagetable_refresh();
+	filemap_copy(current, p);
+	fpu_copy(current, p);
+	p->ring = current->ring;
 	process_inherit(current, p);
 	process_kstack_copy(current, p);
 	strncpy(p->name, current->name, 31);
@@ -303,6 +335,33 @@ int sys_process_stats(struct process_stats *s, int pid)
 	return process_stats(pid, s);
 }
 
+/*
+A process may set the base priority of itself (pid 0) or of its
+children, within the range open to user processes.
+*/
+
+int sys_process_set_priority(int pid, int priority)
+{
+	struct process *p;
+
+	if(priority < PROCESS_PRIORITY_HIGH || priority > PROCESS_PRIORITY_LOW)
+		return KERROR_INVALID_REQUEST;
+
+	if(pid == 0) {
+		p = current;
+	} else if(pid > 0 && pid < PROCESS_MAX_PID && process_table[pid]) {
+		p = process_table[pid];
+	} else {
+		return KERROR_NOT_FOUND;
+	}
+
+	if(p != current && p->ppid != current->pid)
+		return KERROR_PERMISSION_DENIED;
+
+	process_set_priority(p, priority);
+	return 0;
+}
+
 int sys_process_heap(int delta)
 {
 	process_data_size_set(current, current->vm_data_size + delta);
@@ -504,12 +563,156 @@ int sys_object_size(int fd, int *dims, int n)
 	return kobject_size(p, dims, n);
 }
 
+/*
+Map a file into the caller's address space, starting at offset,
+which must be page aligned.  A length of zero maps the rest of the file.
+The address chosen is returned through addr, since user addresses
+do not fit in the non-negative range of a syscall result.
+*/
+
+int sys_object_map(int fd, void **addr, uint32_t length, uint32_t offset)
+{
+	if(!is_valid_object_type(fd,KOBJECT_FILE)) return KERROR_INVALID_OBJECT;
+	if(!is_valid_pointer(addr,sizeof(*addr))) return KERROR_INVALID_ADDRESS;
+
+	uint32_t vaddr;
+	int r = filemap_create(current, current->ktable[fd]->data.file, offset, length, &vaddr);
+	if(r < 0) return r;
+
+	*addr = (void *) vaddr;
+	return 0;
+}
+
+int sys_object_unmap(void *addr)
+{
+	return filemap_delete(current, (uint32_t) addr);
+}
+
 int sys_object_max()
 {
 	int max_fd = process_object_max(current);
 	return max_fd;
 }
 
+/*
+The kernel reads and writes the ring directly, so the whole of it
+must lie within the data segment or the stack of the caller, and
+every page of it already present must be writable by the caller.
+Either segment may shrink after the ring is registered, so this
+is checked again on every entry.
+*/
+
+static int ring_is_valid(struct ring *r)
+{
+	uint32_t start = (uint32_t) r;
+	uint32_t last = start + sizeof(*r) - 1;
+	uint32_t vaddr;
+
+	if(last < start)
+		return 0;
+
+	int in_data = start >= PROCESS_ENTRY_POINT && last < PROCESS_MAP_START && last - PROCESS_ENTRY_POINT < current->vm_data_size;
+	int in_stack = current->vm_stack_size > 0 && start >= -current->vm_stack_size;
+	if(!in_data && !in_stack)
+		return 0;
+
+	for(vaddr = start & PAGE_MASK; vaddr <= last && vaddr >= (start & PAGE_MASK); vaddr += PAGE_SIZE) {
+		unsigned paddr;
+		int flags;
+		if(pagetable_getmap(current->pagetable, vaddr, &paddr, &flags)) {
+			if(flags & PAGE_FLAG_KERNEL)
+				return 0;
+			if(!(flags & (PAGE_FLAG_READWRITE | PAGE_FLAG_COW)))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+Register the ring at the given address in the caller's memory,
+or forget the ring if the address is null.  A forked child
+keeps its copy of the parent's ring, at the same address.
+*/
+
+int sys_ring_setup(struct ring *r)
+{
+	if(r && !ring_is_valid(r)) return KERROR_INVALID_ADDRESS;
+
+	current->ring = r;
+	return 0;
+}
+
+/*
+Carry out one submission, using the same checks as the system call
+it stands for, and counting it in the statistics as that call.
+*/
+
+static int ring_execute(struct ring_submission *s)
+{
+	switch (s->op) {
+	case RING_OP_NOP:
+		return 0;
+	case RING_OP_READ:
+		current->stats.syscall_count[SYSCALL_OBJECT_READ]++;
+		return sys_object_read(s->fd, (void *) s->addr, s->length, s->flags);
+	case RING_OP_WRITE:
+		current->stats.syscall_count[SYSCALL_OBJECT_WRITE]++;
+		return sys_object_write(s->fd, (void *) s->addr, s->length, s->flags);
+	case RING_OP_SEEK:
+		current->stats.syscall_count[SYSCALL_OBJECT_SEEK]++;
+		return sys_object_seek(s->fd, s->length, s->flags);
+	case RING_OP_LIST:
+		current->stats.syscall_count[SYSCALL_OBJECT_LIST]++;
+		return sys_object_list(s->fd, (char *) s->addr, s->length);
+	case RING_OP_GRAPHICS:
+		if(!is_valid_object(s->fd)) return KERROR_INVALID_OBJECT;
+		if(kobject_get_type(current->ktable[s->fd])!=KOBJECT_WINDOW) return KERROR_NOT_A_WINDOW;
+		current->stats.syscall_count[SYSCALL_OBJECT_WRITE]++;
+		return sys_object_write(s->fd, (void *) s->addr, s->length, 0);
+	default:
+		return KERROR_INVALID_REQUEST;
+	}
+}
+
+/*
+Carry out every submission queued in the caller's ring, in order,
+stopping early only if the completion queue fills up.  Each is
+copied out of the ring before it is checked, and no more than
+RING_ENTRIES are taken, whatever the counters in the ring say.
+Returns the number of submissions taken.
+*/
+
+int sys_ring_enter()
+{
+	struct ring *r = current->ring;
+	if(!r) return KERROR_NOT_FOUND;
+	if(!ring_is_valid(r)) return KERROR_INVALID_ADDRESS;
+
+	int count = 0;
+	uint32_t head = r->sq_head;
+
+	while(count < RING_ENTRIES && head != r->sq_tail && r->cq_tail - r->cq_head < RING_ENTRIES) {
+		struct ring_submission s = r->sq[head % RING_ENTRIES];
+		r->sq_head = ++head;
+
+		int result = ring_execute(&s);
+
+		/* The process may have been killed while blocked. */
+		if(current->killed)
+			break;
+
+		uint32_t tail = r->cq_tail;
+		r->cq[tail % RING_ENTRIES].user_data = s.user_data;
+		r->cq[tail % RING_ENTRIES].result = result;
+		r->cq_tail = tail + 1;
+		count++;
+	}
+
+	return count;
+}
+
 int sys_system_stats(struct system_stats *s)
 {
 	if(!is_valid_pointer(s,sizeof(*s))) return KERROR_INVALID_ADDRESS;
@@ -524,6 +727,22 @@ int sys_system_stats(struct system_stats *s)
 		s->blocks_read[i] = a.blocks_read[i];
 	}
 
+	unsigned shared, saved;
+	ksm_stats(&shared, &saved);
+	s->ksm_pages_shared = shared;
+	s->ksm_pages_saved = saved;
+
+	uint32_t zpages, zbytes, zfaults;
+	zram_stats(&zpages, &zbytes, &zfaults);
+	s->zram_pages = zpages;
+	s->zram_bytes = zbytes;
+	s->zram_faults = zfaults;
+
+	uint32_t sused, stotal;
+	swap_stats(&sused, &stotal);
+	s->swap_used = sused;
+	s->swap_total = stotal;
+
 	return 0;
 }
 
@@ -647,6 +866,16 @@ int32_t syscall_handler(syscall_t n, uint32_t a, uint32_t b, uint32_t c, uint32_
 		return sys_system_rtc((struct rtc_time *) a);
 	case SYSCALL_DEVICE_DRIVER_STATS:
 		return sys_device_driver_stats((char *) a, (struct device_driver_stats *) b);
+	case SYSCALL_OBJECT_MAP:
+		return sys_object_map(a, (void **) b, c, d);
+	case SYSCALL_OBJECT_UNMAP:
+		return sys_object_unmap((void *) a);
+	case SYSCALL_PROCESS_SET_PRIORITY:
+		return sys_process_set_priority(a, b);
+	case SYSCALL_RING_SETUP:
+		return sys_ring_setup((struct ring *) a);
+	case SYSCALL_RING_ENTER:
+		return sys_ring_enter();
 	default:
 		return KERROR_INVALID_SYSCALL;
 	}
@@ -0,0 +1,96 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "timepage.h"
+#include "pagetable.h"
+#include "page.h"
+#include "rtc.h"
+#include "console.h"
+#include "kernelcore.h"
+
+static struct time_page *timepage = 0;
+
+/*
+After SYSENTER, the kernel returns to a ret instruction kept at
+the end of the time page, at the same address in every process.
+*/
+
+#define TIMEPAGE_SYSEXIT_OFFSET (PAGE_SIZE - 4)
+
+uint32_t timepage_sysexit = 0;
+
+/*
+Updates come only from interrupt handlers and from initialization,
+all of which hold the kernel lock with interrupts blocked, so there
+is never more than one writer.  The barriers keep the compiler from
+moving the stores of the values outside of the odd sequence.
+*/
+
+static void timepage_begin()
+{
+	timepage->sequence++;
+	asm volatile("":::"memory");
+}
+
+static void timepage_end()
+{
+	asm volatile("":::"memory");
+	timepage->sequence++;
+}
+
+/*
+The library reads the time page without checking that it exists,
+so the kernel does not go on without it.
+*/
+
+void timepage_init()
+{
+	timepage = page_alloc(1);
+	if(!timepage) {
+		printf("timepage: out of memory!\n");
+		halt();
+	}
+
+	((uint8_t *) timepage)[TIMEPAGE_SYSEXIT_OFFSET] = 0xc3;
+	timepage_sysexit = TIME_PAGE_ADDRESS + TIMEPAGE_SYSEXIT_OFFSET;
+}
+
+int timepage_map(struct pagetable *p)
+{
+	if(!timepage)
+		return 0;
+	return pagetable_map(p, TIME_PAGE_ADDRESS, (unsigned) timepage, PAGE_FLAG_USER | PAGE_FLAG_READONLY);
+}
+
+void timepage_set_clock(uint32_t seconds, uint32_t millis)
+{
+	if(!timepage)
+		return;
+	timepage_begin();
+	timepage->seconds = seconds;
+	timepage->millis = millis;
+	timepage_end();
+}
+
+void timepage_set_tsc(uint64_t tsc_start, uint32_t tsc_per_ms)
+{
+	if(!timepage)
+		return;
+	timepage_begin();
+	timepage->tsc_start = tsc_start;
+	timepage->tsc_per_ms = tsc_per_ms;
+	timepage_end();
+}
+
+void timepage_set_rtc(struct rtc_time *t)
+{
+	if(!timepage)
+		return;
+	timepage_begin();
+	timepage->rtc = *t;
+	timepage->time = rtc_time_to_timestamp(t);
+	timepage_end();
+}
@@ -0,0 +1,30 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef TIMEPAGE_H
+#define TIMEPAGE_H
+
+#include "kernel/types.h"
+#include "kernel/timepage.h"
+
+struct pagetable;
+
+/*
+The time page is written by the clock and rtc modules as the time
+changes, and mapped read-only into each new address space by
+process_create.  Address spaces made by pagetable_duplicate share
+the same mapping, since it is not owned by the table.
+*/
+
+extern uint32_t timepage_sysexit;
+
+void timepage_init();
+int  timepage_map(struct pagetable *p);
+void timepage_set_clock(uint32_t seconds, uint32_t millis);
+void timepage_set_tsc(uint64_t tsc_start, uint32_t tsc_per_ms);
+void timepage_set_rtc(struct rtc_time *t);
+
+#endif
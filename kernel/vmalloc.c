@@ -0,0 +1,116 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "vmalloc.h"
+#include "pagetable.h"
+#include "page.h"
+#include "slab.h"
+#include "list.h"
+#include "console.h"
+#include "memorylayout.h"
+#include "kernel/types.h"
+
+/*
+Each allocation is an area of the vmalloc range, recorded on a list
+kept in order of address, so that a free range can be found by
+looking at the gaps between neighboring areas.  Each area is
+followed by an unmapped guard page, so that running off the end
+of one allocation faults instead of corrupting the next.
+*/
+
+struct vmalloc_area {
+	struct list_node node;
+	unsigned vaddr;
+	unsigned npages;
+};
+
+static struct slab_cache vmalloc_area_cache = SLAB_CACHE_INIT("vmalloc_area", sizeof(struct vmalloc_area), 0);
+
+static struct list area_list = LIST_INIT;
+static unsigned pages_mapped = 0;
+
+static void vmalloc_unmap(unsigned vaddr, unsigned npages)
+{
+	unsigned i;
+	for(i = 0; i < npages; i++, vaddr += PAGE_SIZE) {
+		unsigned paddr = pagetable_unmap_kernel(vaddr);
+		if(paddr) {
+			page_free((void *) paddr);
+			pages_mapped--;
+		}
+	}
+}
+
+void *vmalloc(unsigned length)
+{
+	struct list_node *n;
+	unsigned npages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+	unsigned span = (npages + 1) * PAGE_SIZE;
+	unsigned vaddr = KERNEL_VMALLOC_START;
+
+	if(npages == 0)
+		return 0;
+
+	for(n = area_list.head; n; n = n->next) {
+		struct vmalloc_area *a = (struct vmalloc_area *) n;
+		if(a->vaddr - vaddr >= span)
+			break;
+		vaddr = a->vaddr + (a->npages + 1) * PAGE_SIZE;
+	}
+
+	if(span > KERNEL_VMALLOC_END - vaddr) {
+		printf("vmalloc: no room for %d pages\n", npages);
+		return 0;
+	}
+
+	struct vmalloc_area *a = slab_alloc(&vmalloc_area_cache);
+	if(!a)
+		return 0;
+
+	a->vaddr = vaddr;
+	a->npages = npages;
+
+	unsigned i;
+	for(i = 0; i < npages; i++) {
+		void *page = page_alloc(0);
+		if(!page || !pagetable_map_kernel(vaddr + i * PAGE_SIZE, (unsigned) page)) {
+			if(page)
+				page_free(page);
+			vmalloc_unmap(vaddr, i);
+			slab_free(&vmalloc_area_cache, a);
+			printf("vmalloc: out of memory!\n");
+			return 0;
+		}
+		pages_mapped++;
+	}
+
+	list_insert_before(&area_list, n, &a->node);
+
+	return (void *) vaddr;
+}
+
+void vfree(void *ptr)
+{
+	struct list_node *n;
+
+	for(n = area_list.head; n; n = n->next) {
+		struct vmalloc_area *a = (struct vmalloc_area *) n;
+		if(a->vaddr == (unsigned) ptr) {
+			vmalloc_unmap(a->vaddr, a->npages);
+			list_remove(&a->node);
+			slab_free(&vmalloc_area_cache, a);
+			return;
+		}
+	}
+
+	printf("vmalloc: invalid vfree(%x)\n", ptr);
+}
+
+void vmalloc_stats(unsigned *nareas, unsigned *npages)
+{
+	*nareas = list_size(&area_list);
+	*npages = pages_mapped;
+}
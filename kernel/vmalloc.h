@@ -0,0 +1,22 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+/*
+vmalloc() returns memory that is contiguous in kernel virtual
+addresses, but built from individual pages of main memory,
+so it is not limited by the size of the kmalloc area, nor by
+the largest physically contiguous block in the page allocator.
+The pages are visible in every address space.
+*/
+
+void *vmalloc(unsigned length);
+void  vfree(void *ptr);
+void  vmalloc_stats(unsigned *nareas, unsigned *npages);
+
+#endif
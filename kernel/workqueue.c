@@ -0,0 +1,186 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "workqueue.h"
+#include "kthread.h"
+#include "process.h"
+#include "string.h"
+#include "console.h"
+#include "cpu.h"
+
+struct workqueue workqueue_system = WORKQUEUE_INIT("kworker", 2, PROCESS_PRIORITY_HIGH);
+struct workqueue workqueue_background = WORKQUEUE_INIT("kbackground", 1, PROCESS_PRIORITY_LOW);
+
+/*
+Work may be queued from interrupt handlers as well as from ordinary
+kernel code, so interrupts are blocked while a queue is changed,
+and restored to the caller's state afterwards.
+*/
+
+static uint32_t workqueue_lock()
+{
+	uint32_t flags;
+	asm volatile("pushfl; popl %0; cli":"=r"(flags)::"memory");
+	return flags;
+}
+
+static void workqueue_unlock(uint32_t flags)
+{
+	if(flags & 0x200)
+		asm volatile("sti":::"memory");
+}
+
+/*
+Each worker takes items from the head of the queue, and parks when
+the queue is empty.  Since kernel threads are not preempted, a worker
+gives up the processor between items if a more important process
+is waiting for it.
+*/
+
+static void workqueue_worker(void *arg)
+{
+	struct workqueue *q = arg;
+
+	while(!kthread_should_stop()) {
+		uint32_t flags = workqueue_lock();
+		struct work *w = (struct work *) list_pop_head(&q->pending);
+		if(w)
+			w->queue = 0;
+		workqueue_unlock(flags);
+
+		if(!w) {
+			kthread_park();
+			continue;
+		}
+
+		w->func(w);
+		q->completed++;
+
+		if(cpu_self()->preempt_pending)
+			process_yield();
+	}
+}
+
+/*
+Wake one parked worker.  If none is parked, a worker may have found
+the queue empty and be on its way to park, so every worker is marked
+to be unparked, and the next park of each returns at once to look
+at the queue again.
+*/
+
+static void workqueue_wake(struct workqueue *q)
+{
+	int i;
+	for(i = 0; i < q->nworkers; i++) {
+		if(q->workers[i] && kthread_parked(q->workers[i])) {
+			kthread_unpark(q->workers[i]);
+			return;
+		}
+	}
+	for(i = 0; i < q->nworkers; i++) {
+		if(q->workers[i])
+			kthread_unpark(q->workers[i]);
+	}
+}
+
+int workqueue_start(struct workqueue *q)
+{
+	int i;
+	char name[32];
+	char num[12];
+
+	if(q->nworkers > WORKQUEUE_MAX_WORKERS)
+		q->nworkers = WORKQUEUE_MAX_WORKERS;
+
+	for(i = 0; i < q->nworkers; i++) {
+		if(q->workers[i])
+			continue;
+		strcpy(name, q->name);
+		strcat(name, "/");
+		strcat(name, uint_to_string(i, num));
+		q->workers[i] = kthread_create(workqueue_worker, q, name, q->priority);
+		if(!q->workers[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+Stop the workers once they finish the item at hand.
+Items still pending stay queued until the workers are started again.
+*/
+
+void workqueue_stop(struct workqueue *q)
+{
+	int i;
+	for(i = 0; i < q->nworkers; i++) {
+		if(q->workers[i]) {
+			kthread_stop(q->workers[i]);
+			q->workers[i] = 0;
+		}
+	}
+}
+
+void workqueue_init()
+{
+	workqueue_start(&workqueue_system);
+	workqueue_start(&workqueue_background);
+	printf("workqueue: %d system, %d background workers\n", workqueue_system.nworkers, workqueue_background.nworkers);
+}
+
+void work_init(struct work *w, work_func_t func, void *arg)
+{
+	memset(&w->node, 0, sizeof(w->node));
+	w->func = func;
+	w->arg = arg;
+	w->queue = 0;
+}
+
+/*
+Returns 1 if the item was queued, or 0 if it was already pending.
+*/
+
+int work_queue(struct workqueue *q, struct work *w)
+{
+	uint32_t flags = workqueue_lock();
+
+	if(w->queue) {
+		workqueue_unlock(flags);
+		return 0;
+	}
+
+	w->queue = q;
+	list_push_tail(&q->pending, &w->node);
+	workqueue_wake(q);
+
+	workqueue_unlock(flags);
+	return 1;
+}
+
+/*
+Remove a pending item before it runs, returning 1 if it was pending.
+An item that has already started is left to finish.
+*/
+
+int work_cancel(struct work *w)
+{
+	uint32_t flags = workqueue_lock();
+	int pending = w->queue != 0;
+
+	if(pending) {
+		list_remove(&w->node);
+		w->queue = 0;
+	}
+
+	workqueue_unlock(flags);
+	return pending;
+}
+
+int work_pending(struct work *w)
+{
+	return w->queue != 0;
+}
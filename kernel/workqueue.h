@@ -0,0 +1,66 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include "kernel/types.h"
+#include "list.h"
+
+/*
+A work queue runs deferred work in a small pool of kernel threads,
+so that interrupt handlers and system calls can hand off anything
+slow: work_queue only links the item onto the queue and wakes
+an idle worker, and may be called with interrupts blocked.
+An item is on at most one queue at a time, so queueing one that
+is already pending does nothing, and an item may queue itself
+again from its own function to continue later.
+
+Items queued before the workers start are run once they do.
+workqueue_system runs at high priority, for work that someone
+is waiting for, while workqueue_background runs at the lowest
+priority, for work that only needs to be done eventually.
+*/
+
+#define WORKQUEUE_MAX_WORKERS 4
+
+struct work;
+struct workqueue;
+
+typedef void (*work_func_t) (struct work *w);
+
+struct work {
+	struct list_node node;
+	work_func_t func;
+	void *arg;
+	struct workqueue *queue;
+};
+
+struct workqueue {
+	const char *name;
+	int nworkers;
+	int priority;
+	struct list pending;
+	struct process *workers[WORKQUEUE_MAX_WORKERS];
+	uint32_t completed;
+};
+
+#define WORK_INIT(func,arg) {{0,0,0,0},func,arg,0}
+#define WORKQUEUE_INIT(name,nworkers,priority) {name,nworkers,priority,LIST_INIT,{0},0}
+
+extern struct workqueue workqueue_system;
+extern struct workqueue workqueue_background;
+
+void workqueue_init();
+int  workqueue_start(struct workqueue *q);
+void workqueue_stop(struct workqueue *q);
+
+void work_init(struct work *w, work_func_t func, void *arg);
+int  work_queue(struct workqueue *q, struct work *w);
+int  work_cancel(struct work *w);
+int  work_pending(struct work *w);
+
+#endif
@@ -0,0 +1,288 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "zram.h"
+#include "process.h"
+#include "pagetable.h"
+#include "page.h"
+#include "kmalloc.h"
+#include "vmalloc.h"
+#include "string.h"
+#include "console.h"
+
+/*
+Pages are compressed with a small LZ77 coder in the manner of LZRW1:
+the output is a series of groups, each a 16 bit control word followed
+by sixteen items.  A clear control bit is a literal byte, and a set
+bit is a two byte copy of 3 to 18 bytes from up to 4095 bytes back,
+which is enough to reach anywhere in a page.  Matches are found with
+a hash table of the most recent position of each three byte string,
+so compression is a single pass, and decompression simply copies.
+*/
+
+#define ZRAM_HASH_SIZE 4096
+#define ZRAM_MATCH_MIN 3
+#define ZRAM_MATCH_MAX 18
+#define ZRAM_GROUP_MAX (2 + 16 * 2)
+
+/*
+A page that does not compress to at least this size is left alone,
+since storing it would give back too little memory to be worthwhile.
+*/
+
+#define ZRAM_STORED_MAX (PAGE_SIZE * 3 / 4)
+
+#define ZRAM_OBJECTS_MAX 16384
+#define ZRAM_SCAN_MAX 4096
+
+struct zram_object {
+	uint16_t length;
+	uint16_t refs;
+	uint8_t data[0];
+};
+
+static struct zram_object **objects = 0;
+static uint32_t next_handle = 0;
+
+static uint16_t hash_table[ZRAM_HASH_SIZE];
+static uint8_t buffer[ZRAM_STORED_MAX];
+
+static uint32_t pages_stored = 0;
+static uint32_t bytes_stored = 0;
+static uint32_t faults = 0;
+
+static struct process_sweep sweep = PROCESS_SWEEP_INIT;
+
+static unsigned zram_compress(const uint8_t *src, uint8_t *dst, unsigned max)
+{
+	const uint8_t *p = src;
+	const uint8_t *end = src + PAGE_SIZE;
+	uint8_t *out = dst;
+	uint8_t *control = 0;
+	unsigned items = 16;
+	unsigned bits = 0;
+
+	memset(hash_table, 0, sizeof(hash_table));
+
+	while(p < end) {
+		if(items == 16) {
+			if(control) {
+				control[0] = bits;
+				control[1] = bits >> 8;
+			}
+			if(out + ZRAM_GROUP_MAX > dst + max)
+				return 0;
+			control = out;
+			out += 2;
+			items = 0;
+			bits = 0;
+		}
+
+		unsigned length = 0;
+		unsigned offset = 0;
+
+		if(end - p >= ZRAM_MATCH_MIN) {
+			unsigned h = ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) % ZRAM_HASH_SIZE;
+			if(hash_table[h]) {
+				const uint8_t *q = src + hash_table[h] - 1;
+				unsigned limit = MIN(ZRAM_MATCH_MAX, end - p);
+				while(length < limit && q[length] == p[length])
+					length++;
+				offset = p - q;
+			}
+			hash_table[h] = p - src + 1;
+		}
+
+		if(length >= ZRAM_MATCH_MIN) {
+			*out++ = offset >> 4;
+			*out++ = ((offset & 0xf) << 4) | (length - ZRAM_MATCH_MIN);
+			bits |= 1 << items;
+			p += length;
+		} else {
+			*out++ = *p++;
+		}
+
+		items++;
+	}
+
+	control[0] = bits;
+	control[1] = bits >> 8;
+
+	return out - dst;
+}
+
+static int zram_decompress(const uint8_t *src, unsigned length, uint8_t *dst)
+{
+	const uint8_t *end = src + length;
+	uint8_t *out = dst;
+	uint8_t *out_end = dst + PAGE_SIZE;
+
+	while(src + 2 <= end) {
+		unsigned bits = src[0] | (src[1] << 8);
+		unsigned i;
+
+		src += 2;
+
+		for(i = 0; i < 16 && src < end; i++) {
+			if(bits & (1 << i)) {
+				if(src + 2 > end)
+					return 0;
+				unsigned offset = (src[0] << 4) | (src[1] >> 4);
+				unsigned n = (src[1] & 0xf) + ZRAM_MATCH_MIN;
+				src += 2;
+				if(offset == 0 || offset > out - dst || n > out_end - out)
+					return 0;
+				while(n--) {
+					*out = *(out - offset);
+					out++;
+				}
+			} else {
+				if(out >= out_end)
+					return 0;
+				*out++ = *src++;
+			}
+		}
+	}
+
+	return out == out_end;
+}
+
+static struct zram_object *zram_lookup(uint32_t handle, const char *op)
+{
+	if(!objects || handle == 0 || handle > ZRAM_OBJECTS_MAX || !objects[handle - 1]) {
+		printf("zram: invalid %s(%d)\n", op, handle);
+		return 0;
+	}
+	return objects[handle - 1];
+}
+
+/*
+Compress a page into the store, returning its handle.
+Returns 0 if the store is full, or the page does not compress well.
+*/
+
+int zram_store(const void *page, uint32_t *handle)
+{
+	unsigned i;
+
+	if(!objects)
+		return 0;
+
+	unsigned length = zram_compress(page, buffer, sizeof(buffer));
+	if(!length)
+		return 0;
+
+	for(i = 0; i < ZRAM_OBJECTS_MAX; i++) {
+		uint32_t h = (next_handle + i) % ZRAM_OBJECTS_MAX;
+		if(objects[h])
+			continue;
+
+		struct zram_object *o = kmalloc(sizeof(*o) + length);
+		if(!o)
+			return 0;
+
+		o->length = length;
+		o->refs = 1;
+		memcpy(o->data, buffer, length);
+
+		objects[h] = o;
+		next_handle = h + 1;
+		pages_stored++;
+		bytes_stored += length;
+
+		*handle = h + 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+Decompress a stored page into the given page.
+The object remains in the store until freed.
+*/
+
+int zram_load(uint32_t handle, void *page)
+{
+	struct zram_object *o = zram_lookup(handle, "zram_load");
+	if(!o)
+		return 0;
+
+	if(!zram_decompress(o->data, o->length, page)) {
+		printf("zram: object %d is corrupt\n", handle);
+		return 0;
+	}
+
+	faults++;
+	return 1;
+}
+
+/*
+A handle is shared by both page tables after a fork,
+and the object is only released when both let go of it.
+*/
+
+void zram_addref(uint32_t handle)
+{
+	struct zram_object *o = zram_lookup(handle, "zram_addref");
+	if(o)
+		o->refs++;
+}
+
+void zram_free(uint32_t handle)
+{
+	struct zram_object *o = zram_lookup(handle, "zram_free");
+	if(!o)
+		return;
+
+	o->refs--;
+	if(o->refs > 0)
+		return;
+
+	pages_stored--;
+	bytes_stored -= o->length;
+	objects[handle - 1] = 0;
+	kfree(o);
+}
+
+void zram_stats(uint32_t *npages, uint32_t *nbytes, uint32_t *nfaults)
+{
+	*npages = pages_stored;
+	*nbytes = bytes_stored;
+	*nfaults = faults;
+}
+
+static int zram_evict(struct process *p, unsigned vaddr)
+{
+	if(!pagetable_compress(p->pagetable, vaddr))
+		return 0;
+	p->stats.zram_pages_out++;
+	return 1;
+}
+
+/*
+Called by the page allocator under memory pressure:
+compress user pages that have not been touched recently.
+*/
+
+static unsigned zram_shrink(unsigned npages, int can_block)
+{
+	return process_sweep(&sweep, npages, ZRAM_SCAN_MAX, zram_evict);
+}
+
+static struct page_shrinker zram_shrinker = PAGE_SHRINKER_INIT("zram", zram_shrink);
+
+void zram_init()
+{
+	objects = vmalloc(ZRAM_OBJECTS_MAX * sizeof(*objects));
+	if(!objects) {
+		printf("zram: couldn't allocate object table\n");
+		return;
+	}
+	memset(objects, 0, ZRAM_OBJECTS_MAX * sizeof(*objects));
+
+	page_shrinker_register(&zram_shrinker);
+}
@@ -0,0 +1,27 @@
+/*
+Copyright (C) 2015-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef ZRAM_H
+#define ZRAM_H
+
+#include "kernel/types.h"
+
+/*
+The compressed store holds the contents of user pages that have
+not been touched for a while, so that the pages themselves can be
+given back to the allocator when memory runs short.  A stored page
+is named by a small handle, which the page table keeps in place of
+the page address until the process touches the page again.
+*/
+
+void zram_init();
+int  zram_store(const void *page, uint32_t *handle);
+int  zram_load(uint32_t handle, void *page);
+void zram_addref(uint32_t handle);
+void zram_free(uint32_t handle);
+void zram_stats(uint32_t *npages, uint32_t *nbytes, uint32_t *nfaults);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "kernel/types.h"
+#include "kernel/ring.h"
+#include "library/ring.h"
+#include "library/syscalls.h"
+#include "library/malloc.h"
+#include "library/string.h"
+
+struct ring * ring_create()
+{
+	struct ring *r = malloc(sizeof(*r));
+	if(!r) return 0;
+
+	memset(r, 0, sizeof(*r));
+
+	if(syscall_ring_setup(r) < 0) {
+		free(r);
+		return 0;
+	}
+
+	return r;
+}
+
+void ring_delete( struct ring *r )
+{
+	syscall_ring_setup(0);
+	free(r);
+}
+
+static int ring_queue( struct ring *r, int op, int fd, uint32_t addr, int length, int flags, uint32_t user_data )
+{
+	uint32_t tail = r->sq_tail;
+	if(tail - r->sq_head >= RING_ENTRIES) return 0;
+
+	struct ring_submission *s = &r->sq[tail % RING_ENTRIES];
+	s->user_data = user_data;
+	s->op = op;
+	s->fd = fd;
+	s->addr = addr;
+	s->length = length;
+	s->flags = flags;
+
+	r->sq_tail = tail + 1;
+	return 1;
+}
+
+int ring_read( struct ring *r, int fd, void *data, int length, kernel_io_flags_t flags, uint32_t user_data )
+{
+	return ring_queue(r, RING_OP_READ, fd, (uint32_t) data, length, flags, user_data);
+}
+
+int ring_write( struct ring *r, int fd, const void *data, int length, kernel_io_flags_t flags, uint32_t user_data )
+{
+	return ring_queue(r, RING_OP_WRITE, fd, (uint32_t) data, length, flags, user_data);
+}
+
+int ring_seek( struct ring *r, int fd, int offset, int whence, uint32_t user_data )
+{
+	return ring_queue(r, RING_OP_SEEK, fd, 0, offset, whence, user_data);
+}
+
+int ring_list( struct ring *r, int fd, char *buffer, int length, uint32_t user_data )
+{
+	return ring_queue(r, RING_OP_LIST, fd, (uint32_t) buffer, length, 0, user_data);
+}
+
+int ring_graphics( struct ring *r, int fd, const int *commands, int length, uint32_t user_data )
+{
+	return ring_queue(r, RING_OP_GRAPHICS, fd, (uint32_t) commands, length, 0, user_data);
+}
+
+int ring_submit( struct ring *r )
+{
+	if(r->sq_head == r->sq_tail) return 0;
+	return syscall_ring_enter();
+}
+
+int ring_complete( struct ring *r, struct ring_completion *c )
+{
+	uint32_t head = r->cq_head;
+	if(head == r->cq_tail) return 0;
+
+	*c = r->cq[head % RING_ENTRIES];
+	r->cq_head = head + 1;
+	return 1;
+}
@@ -7,6 +7,8 @@ See the file LICENSE for details.
 #include "kernel/syscall.h"
 #include "kernel/stats.h"
 #include "kernel/gfxstream.h"
+#include "kernel/timepage.h"
+#include "kernel/ring.h"
 
 void syscall_debug(const char *str)
 {
@@ -78,6 +80,11 @@ int syscall_process_stats(struct process_stats *s, unsigned int pid)
 	return syscall(SYSCALL_PROCESS_STATS, (uint32_t) s, pid, 0, 0, 0);
 }
 
+int syscall_process_set_priority(unsigned int pid, int priority)
+{
+	return syscall(SYSCALL_PROCESS_SET_PRIORITY, pid, priority, 0, 0, 0);
+}
+
 extern void *syscall_process_heap(int a)
 {
 	return (void *) syscall(SYSCALL_PROCESS_HEAP, a, 0, 0, 0, 0);
@@ -163,11 +170,31 @@ int syscall_object_size(int fd, int *dims, int n)
 	return syscall(SYSCALL_OBJECT_SIZE, fd, (uint32_t) dims, n, 0, 0);
 }
 
+int syscall_object_map(int fd, void **addr, uint32_t length, uint32_t offset)
+{
+	return syscall(SYSCALL_OBJECT_MAP, fd, (uint32_t) addr, length, offset, 0);
+}
+
+int syscall_object_unmap(void *addr)
+{
+	return syscall(SYSCALL_OBJECT_UNMAP, (uint32_t) addr, 0, 0, 0, 0);
+}
+
 int syscall_object_max()
 {
 	return syscall(SYSCALL_OBJECT_MAX, 0, 0, 0, 0, 0);
 }
 
+int syscall_ring_setup(struct ring *r)
+{
+	return syscall(SYSCALL_RING_SETUP, (uint32_t) r, 0, 0, 0, 0);
+}
+
+int syscall_ring_enter()
+{
+	return syscall(SYSCALL_RING_ENTER, 0, 0, 0, 0, 0);
+}
+
 int syscall_system_stats(struct system_stats *s)
 {
 	return syscall(SYSCALL_SYSTEM_STATS, (uint32_t) s, 0, 0, 0, 0);
@@ -183,14 +210,83 @@ int syscall_bcache_flush()
 	return syscall(SYSCALL_BCACHE_FLUSH, 0, 0, 0, 0, 0);
 }
 
+/*
+The time is read from the page that the kernel maps into every
+process and keeps current, without entering the kernel at all.
+See kernel/timepage.h for how it is updated.
+*/
+
+static struct time_page *const time_page = (struct time_page *) TIME_PAGE_ADDRESS;
+
+static uint32_t time_page_begin()
+{
+	uint32_t sequence;
+	while((sequence = time_page->sequence) & 1) {
+	}
+	asm volatile("":::"memory");
+	return sequence;
+}
+
+static int time_page_retry(uint32_t sequence)
+{
+	asm volatile("":::"memory");
+	return time_page->sequence != sequence;
+}
+
+static uint64_t time_divide(uint64_t n, uint32_t d, uint32_t *remainder)
+{
+	uint32_t hi = n >> 32;
+	uint32_t lo = n;
+	uint32_t qhi = hi / d;
+	uint32_t qlo, r = hi % d;
+
+	asm("divl %4":"=a"(qlo), "=d"(r):"a"(lo), "d"(r), "rm"(d));
+
+	*remainder = r;
+	return ((uint64_t) qhi << 32) | qlo;
+}
+
 int syscall_system_time( uint32_t *t )
 {
-	return syscall(SYSCALL_SYSTEM_TIME, (uint32_t)t, 0, 0, 0, 0);
+	uint32_t sequence;
+	do {
+		sequence = time_page_begin();
+		*t = time_page->time;
+	} while(time_page_retry(sequence));
+	return 0;
 }
 
 int syscall_system_rtc( struct rtc_time *time )
 {
-	return syscall(SYSCALL_SYSTEM_RTC, (uint32_t)time, 0, 0, 0, 0);
+	uint32_t sequence;
+	do {
+		sequence = time_page_begin();
+		*time = time_page->rtc;
+	} while(time_page_retry(sequence));
+	return 0;
+}
+
+int syscall_system_uptime( uint32_t *seconds, uint32_t *millis )
+{
+	uint32_t sequence, tsc_per_ms;
+	uint64_t tsc_start;
+
+	do {
+		sequence = time_page_begin();
+		*seconds = time_page->seconds;
+		*millis = time_page->millis;
+		tsc_per_ms = time_page->tsc_per_ms;
+		tsc_start = time_page->tsc_start;
+	} while(time_page_retry(sequence));
+
+	if(tsc_per_ms) {
+		uint32_t lo, hi, r;
+		asm volatile("rdtsc":"=a"(lo), "=d"(hi));
+		uint64_t ms = time_divide((((uint64_t) hi << 32) | lo) - tsc_start, tsc_per_ms, &r);
+		*seconds = time_divide(ms, 1000, millis);
+	}
+
+	return 0;
 }
 
 int syscall_device_driver_stats(char * name, void * stats)